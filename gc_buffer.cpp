@@ -0,0 +1,243 @@
+#include "gc_buffer.hpp"
+
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <thread>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+#define BUFFER_CHUNK ((size_t)2 << 20)  /* Pooled runs are carved out of 2 MB chunks */
+#define BUFFER_IOV   64                 /* Buffers per readv/writev call */
+
+/* Kept in the first bytes of a free run. */
+struct buffer_run
+{
+  buffer_run *next;
+  long long ofs;
+};
+
+static buffer_run *pool_free[GC_BUFFER_CLASSES + 1];
+/* A background sweeper releases while the mutator allocates. */
+static std::atomic_flag pool_lock = ATOMIC_FLAG_INIT;
+static int pool_fd = -2;        /* memfd, -1 for anonymous memory, -2 before first use */
+static long long pool_end;      /* Size of the memfd */
+
+static void pool_lock_acquire()
+{ while(pool_lock.test_and_set(std::memory_order_acquire)) { std::this_thread::yield(); } }
+
+static void pool_lock_release()
+{ pool_lock.clear(std::memory_order_release); }
+
+/* Called with the pool lock held. */
+static char *pool_map(size_t sz, long long *ofs)
+{
+  *ofs = -1;
+
+#if defined(_WIN32)
+  return (char *)VirtualAlloc(0, sz, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+#if defined(__linux__) && defined(SYS_memfd_create)
+  if(pool_fd == -2) { pool_fd = (int)syscall(SYS_memfd_create, "gc_buffer", 1 /* MFD_CLOEXEC */); }
+  if(pool_fd >= 0 && ftruncate(pool_fd, pool_end + sz) == 0)
+  {
+    void *run = mmap(0, sz, PROT_READ | PROT_WRITE, MAP_SHARED, pool_fd, pool_end);
+    if(run != MAP_FAILED)
+    {
+      *ofs = pool_end;
+      pool_end += sz;
+      return (char *)run;
+    }
+  }
+#endif
+
+  void *run = mmap(0, sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  return run == MAP_FAILED ? 0 : (char *)run;
+#endif
+}
+
+/*
+ *  Drops the run's pages from the memfd. The file keeps its
+ *  size and the mapping stays valid: the next write faults in
+ *  fresh pages, while anyone still holding the old ones keeps
+ *  seeing the old data.
+ */
+static void pool_punch(size_t sz, long long ofs)
+{
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+  if(ofs >= 0) { fallocate(pool_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, ofs, sz); }
+#else
+  (void)sz; (void)ofs;
+#endif
+}
+
+static void pool_unmap(char *data, size_t sz, long long ofs)
+{
+#if defined(_WIN32)
+  (void)sz; (void)ofs;
+  VirtualFree(data, 0, MEM_RELEASE);
+#else
+  munmap(data, sz);
+  pool_punch(sz, ofs);
+#endif
+}
+
+/*
+ *  Maps at least `cap` bytes for buf. Recycled runs are not
+ *  cleared, so the contents start out undefined.
+ */
+int gc_buffer_alloc(gc_buffer *buf, size_t cap)
+{
+  size_t npages = (cap + GC_BUFFER_PAGE - 1) / GC_BUFFER_PAGE;
+  if(!npages) { npages = 1; }
+  size_t sz = npages * GC_BUFFER_PAGE;
+  char *data = 0;
+  long long ofs = -1;
+
+  pool_lock_acquire();
+  if(npages > GC_BUFFER_CLASSES) { data = pool_map(sz, &ofs); }
+  else
+  {
+    if(!pool_free[npages])
+    {
+      size_t nruns = BUFFER_CHUNK / sz;
+      char *chunk = pool_map(nruns * sz, &ofs);
+
+      for(size_t i = 0; chunk && i < nruns; i++)
+      {
+        buffer_run *run = (buffer_run *)(chunk + i * sz);
+        run->ofs = ofs < 0 ? -1 : ofs + (long long)(i * sz);
+        run->next = pool_free[npages];
+        pool_free[npages] = run;
+      }
+    }
+
+    buffer_run *run = pool_free[npages];
+    if(run)
+    {
+      pool_free[npages] = run->next;
+      data = (char *)run;
+      ofs = run->ofs;
+    }
+  }
+  pool_lock_release();
+
+  buf->data = data;
+  buf->len = 0;
+  buf->cap = data ? sz : 0;
+  buf->ofs = data ? ofs : -1;
+  buf->sent = 0;
+  return data ? 0 : -1;
+}
+
+void gc_buffer_release(gc_buffer *buf)
+{
+  if(!buf->data) { return; }
+
+  size_t npages = buf->cap / GC_BUFFER_PAGE;
+  if(npages > GC_BUFFER_CLASSES) { pool_unmap(buf->data, buf->cap, buf->ofs); }
+  else
+  {
+    /* Spliced pages can't be rewritten in place. */
+    if(buf->sent) { pool_punch(buf->cap, buf->ofs); }
+
+    buffer_run *run = (buffer_run *)buf->data;
+    run->ofs = buf->ofs;
+
+    pool_lock_acquire();
+    run->next = pool_free[npages];
+    pool_free[npages] = run;
+    pool_lock_release();
+  }
+
+  buf->data = 0;
+  buf->len = buf->cap = 0;
+  buf->ofs = -1;
+  buf->sent = 0;
+}
+
+#ifndef _WIN32
+
+/* Fills the spare capacity of each buffer in order, advancing len. */
+ssize_t gc_buffer_readv(int fd, gc_buffer *const *bufs, int n)
+{
+  struct iovec iov[BUFFER_IOV];
+  int owner[BUFFER_IOV];
+  int niov = 0;
+
+  for(int i = 0; i < n && niov < BUFFER_IOV; i++)
+  {
+    if(bufs[i]->len >= bufs[i]->cap) { continue; }
+    iov[niov].iov_base = bufs[i]->data + bufs[i]->len;
+    iov[niov].iov_len = bufs[i]->cap - bufs[i]->len;
+    owner[niov++] = i;
+  }
+  if(!niov) { return 0; }
+
+  ssize_t got = readv(fd, iov, niov);
+  size_t left = got > 0 ? (size_t)got : 0;
+
+  for(int i = 0; left && i < niov; i++)
+  {
+    size_t take = left < iov[i].iov_len ? left : iov[i].iov_len;
+    bufs[owner[i]]->len += take;
+    left -= take;
+  }
+
+  return got;
+}
+
+/* Writes each buffer's [0, len). Short writes are left to the caller, as with writev. */
+ssize_t gc_buffer_writev(int fd, gc_buffer *const *bufs, int n)
+{
+  struct iovec iov[BUFFER_IOV];
+  int niov = 0;
+
+  for(int i = 0; i < n && niov < BUFFER_IOV; i++)
+  {
+    if(!bufs[i]->len) { continue; }
+    iov[niov].iov_base = bufs[i]->data;
+    iov[niov].iov_len = bufs[i]->len;
+    niov++;
+  }
+  if(!niov) { return 0; }
+
+  return writev(fd, iov, niov);
+}
+
+/*
+ *  Sends [from, from + count) of the payload straight out of
+ *  the pool's memfd. A pipe or socket may still reference the
+ *  pages after this returns, so don't rewrite the sent bytes
+ *  through buf. Releasing buf is fine. Without a memfd this
+ *  is a plain write.
+ */
+ssize_t gc_buffer_sendfile(int out_fd, gc_buffer *buf, size_t from, size_t count)
+{
+  if(from > buf->len) { from = buf->len; }
+  if(count > buf->len - from) { count = buf->len - from; }
+
+#ifdef __linux__
+  if(buf->ofs >= 0)
+  {
+    off_t ofs = (off_t)(buf->ofs + (long long)from);
+    buf->sent = 1;
+    return sendfile(out_fd, pool_fd, &ofs, count);
+  }
+#endif
+
+  return write(out_fd, buf->data + from, count);
+}
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef GC_BUFFER_HPP
+#define GC_BUFFER_HPP
+
+/*
+ *  Off-heap byte buffers.
+ *
+ *  A collector allocates a small object holding a gc_buffer
+ *  and tags it so the sweeper hands the payload back here.
+ *  The payload is a page-aligned run outside the collected
+ *  heap: never scanned, never copied. Runs of up to
+ *  GC_BUFFER_CLASSES pages are recycled through per-size
+ *  free lists, only bigger ones are unmapped when they die.
+ *
+ *  On Linux the pool is backed by a memfd, so a payload can
+ *  go straight to a socket with sendfile. The I/O helpers
+ *  read into and write from the payloads with readv/writev.
+ *
+ *  Keep the buffer object reachable while its data is in
+ *  use: the payload dies with it.
+ */
+
+#include <stddef.h>
+
+#define GC_BUFFER_PAGE    4096
+#define GC_BUFFER_CLASSES 64
+
+struct gc_buffer
+{
+  char *data;     /* Page-aligned payload */
+  size_t len;     /* Bytes in use */
+  size_t cap;     /* Bytes mapped, a multiple of GC_BUFFER_PAGE */
+  long long ofs;  /* Offset in the pool's backing file, -1 if none */
+  int sent;       /* Passed to sendfile, a pipe or socket may still hold the pages */
+};
+
+int  gc_buffer_alloc(gc_buffer *buf, size_t cap);
+void gc_buffer_release(gc_buffer *buf);
+
+#ifndef _WIN32
+#include <sys/types.h>
+
+ssize_t gc_buffer_readv(int fd, gc_buffer *const *bufs, int n);
+ssize_t gc_buffer_writev(int fd, gc_buffer *const *bufs, int n);
+ssize_t gc_buffer_sendfile(int out_fd, gc_buffer *buf, size_t from, size_t count);
+#endif
+
+#endif
@@ -0,0 +1,106 @@
+#include "gc_census.hpp"
+#include "gc_log.hpp"
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+int gc_census_on;
+gc_census_count gc_census_now[GC_CENSUS_KEYS];
+
+static gc_census_count census_prev[GC_CENSUS_KEYS];
+static gc_census_count census_last[GC_CENSUS_KEYS];   /* Last completed census */
+static const char *census_names[GC_CENSUS_KEYS];
+static uint64_t census_cycle;
+
+static gc_log census_log;
+
+void gc_census_enable(const char *path)
+{
+  gc_census_on = 1;
+  census_names[GC_CENSUS_REFARRAY] = "refarray";
+  census_names[GC_CENSUS_ATOMIC] = "atomic";
+  census_names[GC_CENSUS_BUFFER] = "buffer";
+  census_names[GC_CENSUS_OTHER] = "other";
+
+  if(path)
+  {
+    gc_log_init(&census_log, path, "cycle\ttype\tobjs\tbytes\tdobjs\tdbytes\n",
+                GC_CENSUS_LOG_MAX, GC_CENSUS_LOG_KEEP);
+  }
+}
+
+/* The name isn't copied, pass a string that stays around. */
+void gc_census_name(size_t type, const char *name)
+{
+  if(type < GC_CENSUS_TYPES) { census_names[type] = name; }
+}
+
+static const char *census_name(size_t key, char *buf, size_t sz)
+{
+  if(census_names[key]) { return census_names[key]; }
+  snprintf(buf, sz, "type%zu", key);
+  return buf;
+}
+
+static void log_census()
+{
+  char buf[32];
+  FILE *log_file = gc_log_file(&census_log);
+  if(!log_file) { return; }
+
+  for(size_t key = 0; key < GC_CENSUS_KEYS; key++)
+  {
+    gc_census_count *now = &census_last[key], *prev = &census_prev[key];
+    if(!now->objs && !prev->objs) { continue; }
+
+    fprintf(log_file, "%llu\t%s\t%llu\t%llu\t%lld\t%lld\n",
+            (unsigned long long)census_cycle, census_name(key, buf, sizeof(buf)),
+            (unsigned long long)now->objs, (unsigned long long)now->bytes,
+            (long long)(now->objs - prev->objs), (long long)(now->bytes - prev->bytes));
+  }
+  fflush(log_file);
+}
+
+void gc_census_begin()
+{
+  memset(gc_census_now, 0, sizeof(gc_census_now));
+}
+
+void gc_census_end()
+{
+  memcpy(census_prev, census_last, sizeof(census_last));
+  memcpy(census_last, gc_census_now, sizeof(gc_census_now));
+  census_cycle++;
+
+  if(census_log.path) { log_census(); }
+}
+
+/*
+ *  Copies out the last census, one entry per type that was
+ *  live in it or the one before. Returns the number of
+ *  entries, which may be more than max.
+ */
+int gc_census_read(gc_census_entry *out, int max)
+{
+  int n = 0;
+
+  for(size_t key = 0; key < GC_CENSUS_KEYS; key++)
+  {
+    gc_census_count *now = &census_last[key], *prev = &census_prev[key];
+    if(!now->objs && !prev->objs) { continue; }
+
+    if(n < max)
+    {
+      out[n].type = key;
+      out[n].name = census_names[key];
+      out[n].objs = now->objs;
+      out[n].bytes = now->bytes;
+      out[n].dobjs = (int64_t)(now->objs - prev->objs);
+      out[n].dbytes = (int64_t)(now->bytes - prev->bytes);
+    }
+    n++;
+  }
+
+  return n;
+}
@@ -0,0 +1,65 @@
+#ifndef GC_CENSUS_HPP
+#define GC_CENSUS_HPP
+
+/*
+ *  Per-type live heap census.
+ *
+ *  When enabled, the collector counts every object it marks
+ *  under its type id (the strong table index), between
+ *  gc_census_begin and gc_census_end. The result, with deltas
+ *  from the previous collection, can be read back with
+ *  gc_census_read and is appended to a rotating log file.
+ *
+ *  Type ids past GC_CENSUS_TYPES are lumped together as
+ *  "other". Objects without a strong table entry get one of
+ *  the special keys below.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define GC_CENSUS_TYPES    256
+#define GC_CENSUS_REFARRAY (GC_CENSUS_TYPES + 0)
+#define GC_CENSUS_ATOMIC   (GC_CENSUS_TYPES + 1)
+#define GC_CENSUS_BUFFER   (GC_CENSUS_TYPES + 2)
+#define GC_CENSUS_OTHER    (GC_CENSUS_TYPES + 3)
+#define GC_CENSUS_KEYS     (GC_CENSUS_TYPES + 4)
+
+#define GC_CENSUS_LOG_MAX  ((long)1 << 20)   /* Rotate the log past this size */
+#define GC_CENSUS_LOG_KEEP 4                 /* Rotated files kept, path.1 is the newest */
+
+struct gc_census_count
+{
+  uint64_t objs, bytes;
+};
+
+struct gc_census_entry
+{
+  size_t type;
+  const char *name;         /* 0 if never named */
+  uint64_t objs, bytes;
+  int64_t dobjs, dbytes;    /* Change since the previous census */
+};
+
+extern int gc_census_on;
+extern gc_census_count gc_census_now[GC_CENSUS_KEYS];
+
+void gc_census_enable(const char *log_path);
+void gc_census_name(size_t type, const char *name);
+int  gc_census_read(gc_census_entry *out, int max);
+
+/* Collector side. */
+void gc_census_begin();
+void gc_census_end();
+
+static inline size_t gc_census_type(size_t type)
+{ return type < GC_CENSUS_TYPES ? type : GC_CENSUS_OTHER; }
+
+static inline void gc_census_add(size_t key, size_t bytes)
+{
+  gc_census_count *count = &gc_census_now[key < GC_CENSUS_KEYS ? key : GC_CENSUS_OTHER];
+  count->objs++;
+  count->bytes += bytes;
+}
+
+#endif
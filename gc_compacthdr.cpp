@@ -0,0 +1,445 @@
+#include "gc_compacthdr.hpp"
+#include "gc_heap.hpp"
+#include "gc_root.hpp"
+#include "gc_record.hpp"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+
+struct gc_tree
+{
+  gc_tree *parent;
+  gc_tree *children;
+  gc_tree *next;
+  void *data;
+};
+
+static const size_t heap_sz = 1 << 30;
+static const size_t block_sz = 1 << 16;
+#define NBLOCKS (heap_sz / block_sz)
+
+gclen_t strong_table[] =
+{
+  /* No children */
+  0,
+
+  /* gc_tree */
+  4,
+  0, sizeof(void *), 2 * sizeof(void *), 3 * sizeof(void *)
+};
+
+/*
+ *  Slot sizes, header included. Anything bigger than
+ *  the last class gets a run of whole blocks.
+ */
+static const gclen_t class_sz[] =
+{
+  16, 24, 32, 40, 48, 64, 80, 96, 128, 160, 192, 256,
+  320, 384, 512, 768, 1024, 1536, 2048, 4096, 8192
+};
+#define NCLASSES    (sizeof(class_sz) / sizeof(class_sz[0]))
+#define MAX_SMALL   8192
+#define LARGE_CLASS 0xFF
+static unsigned char class_of[MAX_SMALL / sizeof(align_t) + 1];
+
+#define BLOCK_FREE  0
+#define BLOCK_SMALL 1
+#define BLOCK_LARGE 2
+#define BLOCK_TAIL  3   /* Covered by the large object before it */
+
+/*
+ *  Side descriptor for each block. Free slots are threaded
+ *  through their own payloads, so headers need no links.
+ */
+struct gc_block
+{
+  gc_block *next;       /* Next block of this class with free slots */
+  gc_meta *free;
+  uint32_t nfree;
+  uint32_t nblocks;     /* Blocks spanned by a large object */
+  uint16_t sclass;
+  uint16_t state;
+};
+
+static char *heap;
+static gc_block *blocks;
+static gc_block *avail[NCLASSES];
+static size_t block_cursor;
+
+static gc_root_table roots;
+
+#define MARK_STACK_SZ (1 << 20)
+static gc_meta **mark_stack;
+static gclen_t mark_top;
+static int mark_overflow;
+
+#define MIN_TRIGGER (8 << 20)
+static gclen_t live_bytes;
+static gclen_t alloc_bytes;
+
+void gc_init()
+{
+  heap = (char *)gc_heap_map(heap_sz, gc_heap_env_flags());
+  blocks = (gc_block *)gc_heap_map(NBLOCKS * sizeof(gc_block), 0);
+  mark_stack = (gc_meta **)gc_heap_map(MARK_STACK_SZ * sizeof(gc_meta *), 0);
+  assert(heap && blocks && mark_stack);
+
+  for(gclen_t i = 0, c = 0; i <= MAX_SMALL / sizeof(align_t); i++)
+  {
+    while(class_sz[c] < i * sizeof(align_t)) { c++; }
+    class_of[i] = (unsigned char)c;
+  }
+
+  gc_root_init(&roots, 1024);
+
+  live_bytes = 0;
+  alloc_bytes = 0;
+}
+
+/* ---------------------------- Allocation ---------------------------- */
+
+/* Next-fit over the descriptors for a run of free blocks. */
+static gc_block *block_find(size_t nblocks)
+{
+  for(size_t scanned = 0; scanned < NBLOCKS; )
+  {
+    size_t start = block_cursor;
+    size_t run = 0;
+
+    if(start + nblocks > NBLOCKS)
+    {
+      scanned += NBLOCKS - start;
+      block_cursor = 0;
+      continue;
+    }
+    while(run < nblocks && blocks[start + run].state == BLOCK_FREE) { run++; }
+
+    if(run == nblocks)
+    {
+      block_cursor = (start + nblocks) % NBLOCKS;
+      return &blocks[start];
+    }
+    scanned += run + 1;
+    block_cursor = (start + run + 1) % NBLOCKS;
+  }
+  return 0;
+}
+
+static char *block_base(gc_block *b)
+{ return heap + (b - blocks) * block_sz; }
+
+static void block_carve(gc_block *b, unsigned int c)
+{
+  char *base = block_base(b);
+  gclen_t sz = class_sz[c];
+  uint32_t nslots = (uint32_t)(block_sz / sz);
+
+  b->free = 0;
+  for(uint32_t i = nslots; i--; )
+  {
+    gc_meta *slot = (gc_meta *)(base + i * sz);
+    memset(slot, 0, sizeof(gc_meta));
+    *(gc_meta **)(slot + 1) = b->free;
+    b->free = slot;
+  }
+  b->nfree = nslots;
+  b->sclass = (uint16_t)c;
+  b->state = BLOCK_SMALL;
+  b->next = 0;
+}
+
+static gc_meta *small_alloc(unsigned int c)
+{
+  gc_block *b = avail[c];
+
+  if(!b)
+  {
+    if(!(b = block_find(1))) { return 0; }
+    block_carve(b, c);
+    avail[c] = b;
+  }
+
+  gc_meta *slot = b->free;
+  b->free = *(gc_meta **)(slot + 1);
+  *(gc_meta **)(slot + 1) = 0;
+  if(!--b->nfree) { avail[c] = b->next; }
+
+  slot->sclass = c;
+  return slot;
+}
+
+static gc_meta *large_alloc(gclen_t true_len)
+{
+  uint32_t nblocks = (uint32_t)((true_len + block_sz - 1) / block_sz);
+  gc_block *b = block_find(nblocks);
+  if(!b) { return 0; }
+
+  b->state = BLOCK_LARGE;
+  b->nblocks = nblocks;
+  for(uint32_t i = 1; i < nblocks; i++) { b[i].state = BLOCK_TAIL; }
+
+  gc_meta *retmeta = (gc_meta *)block_base(b);
+  retmeta->sclass = LARGE_CLASS;
+  return retmeta;
+}
+
+void *gc_create_ref(gclen_t len, gclen_t srtptr, int flags)
+{
+  gclen_t true_len = (len + sizeof(gc_meta) + sizeof(align_t) - 1) &
+                     ~(sizeof(align_t) - 1);
+  int small = true_len <= MAX_SMALL;
+
+  if(alloc_bytes >= MIN_TRIGGER && alloc_bytes >= live_bytes) { gc_trace(); }
+
+  gc_meta *retmeta = small ? small_alloc(class_of[true_len / sizeof(align_t)])
+                           : large_alloc(true_len);
+  if(!retmeta)
+  {
+    gc_trace();
+    retmeta = small ? small_alloc(class_of[true_len / sizeof(align_t)])
+                    : large_alloc(true_len);
+    if(!retmeta) { return 0; }
+  }
+
+  retmeta->srtptr = srtptr;
+  retmeta->refarray = flags & REFARRAY_FLAG ? 1 : 0;
+  retmeta->mark = 0;
+  retmeta->rooted = 0;
+  retmeta->allocated = 1;
+  alloc_bytes += small ? class_sz[retmeta->sclass] : true_len;
+
+  if(flags & ROOT_FLAG) { gc_inc_rrcnt(retmeta + 1); }
+  return retmeta + 1;
+}
+
+void gc_dec_rrcnt(void *alloc)
+{
+  gc_meta *retmeta = ((gc_meta *)alloc) - 1;
+  if(!alloc || !retmeta->rooted) { return; }
+
+  gc_root *entry = gc_root_find(&roots, retmeta);
+  if(--entry->rrcnt <= 0)
+  {
+    gc_root_remove(&roots, entry);
+    retmeta->rooted = 0;
+  }
+}
+
+void gc_inc_rrcnt(void *alloc)
+{
+  gc_meta *retmeta = ((gc_meta *)alloc) - 1;
+  if(!alloc) { return; }
+
+  gc_root *entry = retmeta->rooted ? gc_root_find(&roots, retmeta) : gc_root_insert(&roots, retmeta);
+  entry->rrcnt++;
+  retmeta->rooted = 1;
+}
+
+/* ------------------------------ Tracing ----------------------------- */
+
+static void mark_push(gc_meta *meta)
+{
+  meta->mark = 1;
+  if(mark_top < MARK_STACK_SZ) { mark_stack[mark_top++] = meta; }
+  else { mark_overflow = 1; }
+}
+
+static void mark_children(gc_meta *current)
+{
+  if(current->refarray)
+  {
+    void **children = (void **)(current + 1);
+    for(gclen_t i = 0; i < current->srtptr; i++)
+    {
+      gc_meta *check_mark = (gc_meta *)children[i];
+      if(check_mark-- && !check_mark->mark) { mark_push(check_mark); }
+    }
+  }
+  else
+  {
+    gclen_t nchildren = strong_table[current->srtptr];
+    char *base = (char *)(current + 1);
+    for(gclen_t i = current->srtptr + 1; nchildren--; i++)
+    {
+      gc_meta *check_mark = *(gc_meta **)(base + strong_table[i]);
+      if(check_mark-- && !check_mark->mark) { mark_push(check_mark); }
+    }
+  }
+}
+
+static void mark_drain()
+{
+  while(mark_top) { mark_children(mark_stack[--mark_top]); }
+}
+
+/*
+ *  On overflow some marked objects never had their children
+ *  pushed. Rescan every marked object until nothing spills.
+ */
+static void mark_rescan()
+{
+  while(mark_overflow)
+  {
+    mark_overflow = 0;
+    for(size_t i = 0; i < NBLOCKS; i++)
+    {
+      gc_block *b = &blocks[i];
+      char *base = block_base(b);
+
+      if(b->state == BLOCK_LARGE)
+      {
+        gc_meta *meta = (gc_meta *)base;
+        if(meta->mark) { mark_children(meta); mark_drain(); }
+      }
+      else if(b->state == BLOCK_SMALL)
+      {
+        gclen_t sz = class_sz[b->sclass];
+        for(char *slot = base; slot + sz <= base + block_sz; slot += sz)
+        {
+          gc_meta *meta = (gc_meta *)slot;
+          if(meta->allocated && meta->mark) { mark_children(meta); mark_drain(); }
+        }
+      }
+    }
+  }
+}
+
+/*
+ *  Free memory is kept zeroed, so allocation needn't clear
+ *  it. Free blocks are all zero. A free slot in a block
+ *  still in use is zero past its link, which the allocator
+ *  clears as it takes the slot.
+ */
+static void sweep()
+{
+  gclen_t local_live = 0;
+  gc_heap_run dead = { 0, 0 };
+
+  for(unsigned int c = 0; c < NCLASSES; c++) { avail[c] = 0; }
+
+  for(size_t i = 0; i < NBLOCKS; i++)
+  {
+    gc_block *b = &blocks[i];
+    char *base = block_base(b);
+
+    if(b->state == BLOCK_LARGE)
+    {
+      gc_meta *meta = (gc_meta *)base;
+      uint32_t nblocks = b->nblocks;
+
+      if(meta->mark)
+      {
+        meta->mark = 0;
+        local_live += nblocks * block_sz;
+      }
+      else
+      {
+        for(uint32_t j = 0; j < nblocks; j++) { b[j].state = BLOCK_FREE; }
+        gc_heap_zero_add(&dead, base, nblocks * block_sz);
+      }
+      i += nblocks - 1;
+    }
+    else if(b->state == BLOCK_SMALL)
+    {
+      gclen_t sz = class_sz[b->sclass];
+      uint32_t nslots = (uint32_t)(block_sz / sz);
+      uint32_t nlive = 0;
+
+      for(uint32_t j = 0; j < nslots; j++)
+      {
+        gc_meta *meta = (gc_meta *)(base + j * sz);
+        nlive += meta->allocated && meta->mark;
+      }
+
+      /* It may be carved into another class or a large run next, headers and all. */
+      if(!nlive)
+      {
+        b->state = BLOCK_FREE;
+        gc_heap_zero_add(&dead, base, block_sz);
+        continue;
+      }
+
+      b->free = 0;
+      b->nfree = 0;
+      for(uint32_t j = nslots; j--; )
+      {
+        gc_meta *meta = (gc_meta *)(base + j * sz);
+        if(meta->allocated && meta->mark)
+        {
+          meta->mark = 0;
+          continue;
+        }
+
+        if(meta->allocated) { memset(meta + 1, 0, sz - sizeof(gc_meta)); }
+        meta->allocated = 0;
+        *(gc_meta **)(meta + 1) = b->free;
+        b->free = meta;
+        b->nfree++;
+      }
+
+      local_live += nlive * sz;
+      if(b->nfree)
+      {
+        b->next = avail[b->sclass];
+        avail[b->sclass] = b;
+      }
+    }
+  }
+
+  gc_heap_zero_flush(&dead);
+  live_bytes = local_live;
+  alloc_bytes = 0;
+}
+
+void gc_trace()
+{
+  /* Roots come straight from the side table, no heap walk needed. */
+  for(gclen_t i = 0; i <= roots.mask; i++)
+  {
+    gc_meta *meta = (gc_meta *)roots.roots[i].obj;
+    if(meta && !meta->mark)
+    {
+      mark_push(meta);
+      mark_drain();
+    }
+  }
+  mark_rescan();
+
+  sweep();
+}
+
+/* ./gc_compacthdr replay <trace> runs a GC_RECORD trace against this collector. */
+static void *replay_create(size_t len, size_t type, int flags)
+{ return gc_create_ref(len, type, flags); }
+
+static void replay_store(void *obj, size_t offset, void *value)
+{ *(void **)((char *)obj + offset) = value; }
+
+static const gc_replay_ops replay_ops =
+{
+  replay_create, 0, gc_inc_rrcnt, gc_dec_rrcnt, replay_store, gc_trace
+};
+
+int main(int argc, char **argv)
+{
+  gc_init();
+  if(argc > 2 && !strcmp(argv[1], "replay")) { return gc_replay(argv[2], &replay_ops); }
+
+  printf("header: %u bytes, gc_tree slot: %u bytes\r\n",
+         (unsigned)sizeof(gc_meta),
+         (unsigned)class_sz[class_of[(sizeof(gc_tree) + sizeof(gc_meta)) / sizeof(align_t)]]);
+
+  while(1)
+  {
+    gc_tree *root = (gc_tree *)gc_create_ref(sizeof (gc_tree), 1, ROOT_FLAG);
+    root->children = (gc_tree *)gc_create_ref(sizeof (gc_tree), 1, 0);
+    root->children->parent = root;
+    root->children->next = (gc_tree *)gc_create_ref(sizeof (gc_tree), 1, 0);
+    root->children->next->parent = root;
+    gc_dec_rrcnt(root);
+    printf("%p\r\n", (void *)root);
+  }
+  return 0;
+}
@@ -0,0 +1,40 @@
+#ifndef GC_COMPACTHDR_HPP
+#define GC_COMPACTHDR_HPP
+
+/*
+ *  Stop-the-world tracer with an 8-byte object header.
+ *
+ *  Same interface as gc_stwtrace, but objects live in
+ *  size-segregated blocks. Allocation links live in the
+ *  per-block descriptors and root counts live in a side
+ *  table, so the header only packs the type id, the size
+ *  class and the flags.
+ */
+
+#include <stdint.h>
+
+typedef int64_t gcrcnt_t;
+typedef uint64_t gclen_t;
+typedef uint64_t align_t;
+
+struct gc_meta
+{
+  gclen_t srtptr    : 48;   /* Strong table index, or # of refs for arrays */
+  gclen_t sclass    : 8;    /* Size class, LARGE_CLASS for block runs */
+  gclen_t refarray  : 1;
+  gclen_t mark      : 1;
+  gclen_t rooted    : 1;    /* Has an entry in the root table */
+  gclen_t allocated : 1;
+  gclen_t           : 4;
+};
+
+#define ROOT_FLAG     1
+#define REFARRAY_FLAG 2
+
+void gc_init();
+void *gc_create_ref(gclen_t len, gclen_t srtptr, int flags);
+void gc_dec_rrcnt(void *alloc);
+void gc_inc_rrcnt(void *alloc);
+void gc_trace();
+
+#endif
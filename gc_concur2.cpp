@@ -1,6 +1,8 @@
 #include "gc_concur2.hpp"
+#include "gc_heap.hpp"
+#include "gc_phase.hpp"
+#include "gc_mark.hpp"
 
-#include <vector>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,17 +10,56 @@
 #include <windows.h>
 #include <assert.h>
 
-using std::vector;
-
 static gcofs_t strong_table[] = {0};
 static const size_t heap_sz = 1 << 30;
 static align_t *test_heap;
 
 static volatile int please_collect;
 
+/*
+ *  Free memory travels from the sweeper to the allocator as
+ *  blocks through a single-producer single-consumer ring. The
+ *  sweeper coalesces dead neighbours and zeroes them before
+ *  publishing, so the allocator only bumps through blocks and
+ *  never walks the heap.
+ */
+struct gc_block
+{
+  char *start;
+  gclen_t len;
+};
+
+#define FREE_RING 4096    /* Power of two */
+static gc_block free_ring[FREE_RING];
+static volatile gclen_t ring_head;     /* Next block the allocator pops */
+static volatile gclen_t ring_tail;     /* Next slot the sweeper fills */
+static volatile gclen_t ncycles;       /* Completed sweeper cycles */
+
+/* Allocator side */
+static char *alloc_ptr, *alloc_end;    /* Block being bumped through */
+static gc_meta *pending;               /* New objects since the last hand off */
+static gc_meta *volatile handed;       /* Picked up by the sweeper */
+
+/*
+ *  Sweeper side. Blocks that didn't fit in the ring yet, oldest
+ *  first, linked through their own first words. Every block
+ *  has room for a header, so this needs no memory of its own.
+ */
+struct gc_backlog_node
+{
+  gclen_t len;
+  gc_backlog_node *next;
+};
+
+static gc_backlog_node *backlog_head, *backlog_tail;
+
+/* Mapped once in gc_init, marking never allocates. */
+#define MARK_STACK_SZ ((size_t)1 << 20)
+static gc_mark_stack mark_stack;
+
 void gc_init()
 {
-  test_heap = (align_t *)malloc(heap_sz);
+  test_heap = (align_t *)gc_heap_map(heap_sz, gc_heap_env_flags());
 
   /*
    * It's very important that the test heap be
@@ -30,201 +71,374 @@ void gc_init()
   gc_meta *begin = (gc_meta *)test_heap;
   begin->rrcnt = 1;
   begin->mark = 1;
-  begin->sweep = 0;
   begin->refarray = 0;
   begin->srtptr = 0;
   begin->len = sizeof(gc_meta);
   begin->alloc_next = 0;
-  begin->mark_next = 0;
+
+  /* The rest of the heap is the first free block. */
+  free_ring[0].start = (char *)(begin + 1);
+  free_ring[0].len = (char *)test_heap + heap_sz - free_ring[0].start;
+  ring_tail = 1;
+
+  gc_mark_init(&mark_stack, gc_heap_map(MARK_STACK_SZ, 0), MARK_STACK_SZ);
+
+  /* Hardware counters per phase, GC_PERF_LOG=path also logs each cycle. */
+  const char *perf_env = getenv("GC_PERF");
+  const char *perf_log = getenv("GC_PERF_LOG");
+  if((perf_env && atoi(perf_env)) || perf_log) { gc_perf_enable(perf_log); }
+
+  /* Timeline for chrome://tracing, written at exit, e.g. GC_EVENTS=gc.json */
+  const char *events = getenv("GC_EVENTS");
+  if(events)
+  {
+    gc_event_enable(events);
+    gc_event_name_thread("mutator");
+  }
 
   CreateThread(0, 0, (LPTHREAD_START_ROUTINE)sweeper_thread, 0, 0, 0);
 }
 
 /*
- *  For gc_create_ref and sweeper_thread, note that they share
- *  the mark list. Writes to this list will be synchronized
- *  and if the allocator needs to add a node, it will keep
- *  a private addme list and will add everything in that
- *  list for the next time it gets permission to write.
+ *  Hand new objects to the sweeper when it asks nicely.
+ *  It only takes the list, the sweeper sorts them into
+ *  the heap list itself.
+ */
+static void hand_off()
+{
+  if(please_collect)
+  {
+    if(gc_event_on) { gc_event_instant("hand off", 0); }
+    handed = pending;
+    pending = 0;
+    MemoryBarrier();
+    please_collect = 0;
+  }
+}
+
+/*
+ *  The unused rest of a block becomes a dead filler object,
+ *  so the sweeper can coalesce it with its neighbours.
+ */
+static void retire_block()
+{
+  gclen_t rest = alloc_end - alloc_ptr;
+
+  if(rest)
+  {
+    gc_meta *filler = (gc_meta *)alloc_ptr;
+    filler->rrcnt = 0;
+    filler->mark = 0;
+    filler->refarray = 0;
+    filler->srtptr = 0;
+    filler->len = rest;
+    filler->alloc_next = pending;
+    pending = filler;
+  }
+  alloc_ptr = alloc_end = 0;
+}
+
+static int pop_block()
+{
+  gclen_t start_cycle = ncycles;
+  int stalled = gc_event_on && ring_head == ring_tail;
+
+  if(stalled) { gc_event_begin("alloc stall"); }
+  while(ring_head == ring_tail)
+  {
+    /* Everything dead by now has been offered. The heap is full. */
+    if(ncycles - start_cycle >= 2)
+    {
+      if(stalled) { gc_event_end("alloc stall"); }
+      return 0;
+    }
+    hand_off();
+    Sleep(0);
+  }
+  if(stalled) { gc_event_end("alloc stall"); }
+
+  MemoryBarrier();
+  gc_block *block = &free_ring[ring_head % FREE_RING];
+  alloc_ptr = block->start;
+  alloc_end = block->start + block->len;
+  MemoryBarrier();
+  ring_head = ring_head + 1;
+
+  return 1;
+}
+
+/*
+ *  Blocks are already zeroed, so only the header is written.
+ *  Objects go on the private pending list until the sweeper
+ *  takes them, there's no shared list to synchronize on.
  */
 void *gc_create_ref(gclen_t len, gcofs_t srtptr, int flags)
 {
   gclen_t true_len = (len + sizeof(gc_meta) + sizeof(align_t) - 1) &
                      ~(sizeof(align_t) - 1);
 
-  gc_meta *begin = (gc_meta *)test_heap;
-  gc_meta *trail, *prev_trail;
-  gc_meta *check_mark;
-  char *test = (char *)(begin + 1);
+  hand_off();
 
-  /*
-   *  Collect when the tracer asks you nicely.
-   */
-  if(please_collect)
+  while((gclen_t)(alloc_end - alloc_ptr) < true_len)
   {
-    begin->mark_next = 0;
-    trail = begin->alloc_next;
-    prev_trail = begin;
+    retire_block();
+    if(!pop_block()) { return 0; }
+  }
 
-    while(trail)
-    {
-      if(!trail->sweep)
-      {
-        trail->mark_next = begin->mark_next;
-        begin->mark_next = trail;
-        prev_trail->alloc_next = trail;
-        prev_trail = trail;
-      }
-      trail = trail->alloc_next;
-    }
-    prev_trail->alloc_next = 0;
-    please_collect = 0;
+  /* Never leave a rest too small to hold a filler. */
+  gclen_t rest = alloc_end - alloc_ptr - true_len;
+  if(rest && rest < sizeof(gc_meta)) { true_len += rest; }
+
+  gc_meta *retmeta = (gc_meta *)alloc_ptr;
+  alloc_ptr += true_len;
+
+  retmeta->rrcnt = 1;
+  retmeta->mark = 1;
+  retmeta->refarray = flags & REFARRAY_FLAG ? 1 : 0;
+  retmeta->srtptr = srtptr;
+  retmeta->len = true_len;
+  retmeta->alloc_next = pending;
+  pending = retmeta;
+
+  return retmeta + 1;
+}
+
+static void publish(gc_block block)
+{
+  if(ring_tail - ring_head == FREE_RING)
+  {
+    gc_backlog_node *node = (gc_backlog_node *)block.start;
+    node->len = block.len;
+    node->next = 0;
+    if(backlog_tail) { backlog_tail->next = node; }
+    else { backlog_head = node; }
+    backlog_tail = node;
+    return;
   }
 
-  /*
-   *  Use begin to ensure prev_trail is never null
-   */
-  prev_trail = begin;
-  trail = prev_trail->alloc_next;
+  free_ring[ring_tail % FREE_RING] = block;
+  MemoryBarrier();
+  ring_tail = ring_tail + 1;
+}
 
+/* Cuts the ascending run off the front of the list. */
+static gc_meta *cut_run(gc_meta **list)
+{
+  gc_meta *run = *list, *last = run;
 
-  /*
-   *  If there's space at the beginning of the alloc list,
-   *  put it at the beginning and mark it for adding to
-   *  the mark list. Note that for all additions, it's very, very
-   *  important to complete all initialization before adding it
-   *  to the addme or mark lists.
-   */
-  if(trail != begin + 1 && test + true_len < (char *)trail)
+  while(last->alloc_next && last < last->alloc_next) { last = last->alloc_next; }
+  *list = last->alloc_next;
+  last->alloc_next = 0;
+  return run;
+}
+
+/* Appends the merge of two ascending runs at tail, returns the new tail. */
+static gc_meta **merge_runs(gc_meta *a, gc_meta *b, gc_meta **tail)
+{
+  while(a && b)
   {
-    gc_meta *retmeta = (gc_meta *)test;
-    retmeta->rrcnt = 1;
-    retmeta->mark = 1;
-    retmeta->sweep = 0;
-    retmeta->srtptr = srtptr;
-    retmeta->len = true_len;
-    retmeta->alloc_next = trail;
-    memset(retmeta + 1, 0, len);
-    begin->alloc_next = retmeta;
-
-    return retmeta + 1; 
+    gc_meta **least = a < b ? &a : &b;
+    *tail = *least;
+    tail = &(*least)->alloc_next;
+    *least = (*least)->alloc_next;
   }
 
-  /*
-   *  Otherwise, try to find space in the list
-   *  which is available.
-   */
-  while(trail)
+  *tail = a ? a : b;
+  while(*tail) { tail = &(*tail)->alloc_next; }
+  return tail;
+}
+
+/*
+ *  Objects come newest first. Reversed, they ascend through
+ *  each block the allocator bumped through, so merging those
+ *  runs takes a pass per doubling of blocks, not of objects.
+ */
+static gc_meta *sort_chain(gc_meta *list)
+{
+  gc_meta *reversed = 0;
+  while(list)
+  {
+    gc_meta *next = list->alloc_next;
+    list->alloc_next = reversed;
+    reversed = list;
+    list = next;
+  }
+  list = reversed;
+
+  while(1)
   {
-    test = (char *)trail + trail->len;
-    gc_meta *local_next = trail->alloc_next;
+    gc_meta *sorted = 0, **tail = &sorted;
+    gclen_t nruns = 0;
 
-    if(test + true_len < (char *)local_next)
+    while(list)
     {
-      gc_meta *retmeta = (gc_meta *)test;
-      retmeta->rrcnt = 1;
-      retmeta->mark = 1;
-      retmeta->sweep = 0;
-      retmeta->srtptr = srtptr;
-      retmeta->len = true_len;
-      retmeta->alloc_next = local_next;
-      memset(retmeta + 1, 0, len);
-      trail->alloc_next = retmeta;
-
-      return retmeta + 1;
+      gc_meta *a = cut_run(&list);
+      gc_meta *b = list ? cut_run(&list) : 0;
+      tail = merge_runs(a, b, tail);
+      nruns++;
     }
-    else
+    if(nruns <= 1) { return sorted; }
+    list = sorted;
+  }
+}
+
+/* Sort the handed objects into the address ordered heap list. */
+static void merge_handed(gc_meta *begin, gc_meta *chain)
+{
+  gc_meta *prev = begin;
+
+  chain = sort_chain(chain);
+  while(chain)
+  {
+    gc_meta *next = prev->alloc_next;
+    if(!next || chain < next)
     {
-      prev_trail = trail;
-      trail = local_next;
+      gc_meta *born = chain;
+      chain = chain->alloc_next;
+      born->alloc_next = next;
+      prev->alloc_next = born;
+      prev = born;
     }
+    else { prev = next; }
   }
+}
 
-  /* 
-   *  If no node was found in the middle, but there's still space
-   *  at the end, allocate the node at the end while marking it
-   *  for addition into the mark list.
-   */
-  if(!trail && test + true_len < (char *)test_heap + heap_sz)
+/* 
+ * TO-DO: Mark behavior changes with reference array 
+ */
+static void mark_children(gc_mark_stack *stack, void *obj)
+{
+  gc_meta *current = (gc_meta *)obj;
+  void *base = current + 1;
+  gcofs_t nchildren = strong_table[current->srtptr];
+
+  for(gcofs_t i = current->srtptr + 1; nchildren--; i++)
   {
-    gc_meta *retmeta = (gc_meta *)test;
-    retmeta->rrcnt = 1;
-    retmeta->mark = 1;
-    retmeta->sweep = 0;
-    retmeta->srtptr = srtptr;
-    retmeta->len = true_len;
-    retmeta->alloc_next = 0;
-    memset(retmeta + 1, 0, len);
-    prev_trail->alloc_next = retmeta;
-
-    return retmeta + 1;
+    gc_meta *child_meta = *(gc_meta **)((char *)base + strong_table[i]);
+    if(child_meta-- && !child_meta->mark)
+    {
+      child_meta->mark = 1;
+      gc_mark_push(stack, child_meta);
+    }
   }
+}
 
-  return 0;
+static void *mark_next_marked(void *obj)
+{
+  gc_meta *meta = obj ? ((gc_meta *)obj)->alloc_next : ((gc_meta *)test_heap)->alloc_next;
+  while(meta && !meta->mark) { meta = meta->alloc_next; }
+  return meta;
 }
 
+static const gc_mark_heap mark_heap = { mark_children, mark_next_marked, 0 };
+
 void sweeper_thread()
 {
   gc_meta *local_meta;
   gc_meta *local_prev;
   gc_meta *begin = (gc_meta *)test_heap;
 
+  if(gc_event_on) { gc_event_name_thread("sweeper"); }
   while(1)
   {
 /* ------------------------------------ */
+    if(gc_event_on) { gc_event_begin("handshake"); }
     while(please_collect) {}
+    MemoryBarrier();
+    if(gc_event_on)
+    {
+      gc_event_end("handshake");
+      gc_event_instant("cycle start", 0);
+    }
+    merge_handed(begin, handed);
+    handed = 0;
+
+    /* Retry what didn't fit last time, zeroed again where the link was. */
+    while(backlog_head && ring_tail - ring_head < FREE_RING)
+    {
+      gc_backlog_node *node = backlog_head;
+      gc_block block = {(char *)node, node->len};
+
+      backlog_head = node->next;
+      if(!backlog_head) { backlog_tail = 0; }
+      memset(node, 0, sizeof(gc_backlog_node));
+      publish(block);
+    }
 
     /* Clear */
-    local_meta = begin->mark_next;
+    gc_phase_begin(GC_PERF_CLEAR);
+    local_meta = begin->alloc_next;
     while(local_meta)
     {
       local_meta->mark = 0;
-      local_meta = local_meta->mark_next;
+      local_meta = local_meta->alloc_next;
     }
+    gc_phase_end(GC_PERF_CLEAR);
+    gc_phase_begin(GC_PERF_MARK);
 
     /* Mark */
-    local_meta = begin->mark_next;
+    local_meta = begin->alloc_next;
     while(local_meta)
     {
       if(local_meta->rrcnt > 0 && !local_meta->mark)
       {
         local_meta->mark = 1;
-        vector<gc_meta *> rem = vector<gc_meta *>();
-        rem.push_back(local_meta);
-        
-        while(rem.size())
-        {
-          gc_meta *current = rem.back();
-          void *base = current + 1;
-          rem.pop_back();
-
-          /* 
-           * TO-DO: Mark behavior changes with reference array 
-           */
-          gcofs_t nchildren = strong_table[current->srtptr];
-          for(gcofs_t i = current->srtptr + 1; nchildren--; i++)
-          {
-            gc_meta *child_meta = *(gc_meta **)((char *)base + strong_table[i]);
-            if(child_meta-- && !child_meta->mark)
-            {
-              child_meta->mark = 1;
-              rem.push_back(child_meta);
-            }
-          }
-        }
+        gc_mark_push(&mark_stack, local_meta);
+        gc_mark_drain(&mark_stack, &mark_heap);
       }
-      local_meta = local_meta->mark_next;
+      local_meta = local_meta->alloc_next;
     }
+    gc_mark_finish(&mark_stack, &mark_heap);
+    gc_phase_end(GC_PERF_MARK);
+    gc_phase_begin(GC_PERF_SWEEP);
 
-    /* Sweep */
-    local_meta = begin->mark_next;
+    /*
+     *  Sweep: unlink the dead and merge runs of them that
+     *  touch into one block. Blocks the allocator still owns
+     *  aren't on the list, so a run never grows across one.
+     */
+    gc_block run = {0, 0};
+    local_prev = begin;
+    local_meta = begin->alloc_next;
     while(local_meta)
     {
-      if(!local_meta->mark)
+      gc_meta *local_next = local_meta->alloc_next;
+
+      if(local_meta->mark)
       {
-        local_meta->sweep = 1;
+        local_prev->alloc_next = local_meta;
+        local_prev = local_meta;
+      }
+      else if(run.start && run.start + run.len == (char *)local_meta)
+      { run.len += local_meta->len; }
+      else
+      {
+        if(run.start)
+        {
+          gc_heap_zero(run.start, run.len);
+          publish(run);
+        }
+        run.start = (char *)local_meta;
+        run.len = local_meta->len;
       }
-      local_meta = local_meta->mark_next;
+
+      local_meta = local_next;
+    }
+    local_prev->alloc_next = 0;
+    if(run.start)
+    {
+      gc_heap_zero(run.start, run.len);
+      publish(run);
+    }
+
+    gc_phase_end(GC_PERF_SWEEP);
+    ncycles = ncycles + 1;
+    gc_phase_cycle_end(ncycles);
+
+    if(gc_event_on)
+    {
+      gc_event_counter("free_blocks", ring_tail - ring_head);
+      gc_event_instant("request hand off", 0);
     }
     please_collect = 1;
 /* ------------------------------------ */
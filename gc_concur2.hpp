@@ -12,12 +12,10 @@ struct gc_meta
 {
   volatile gcrcnt_t rrcnt        : 50;
   volatile gcrcnt_t mark         : 1;
-  volatile gcrcnt_t sweep        : 1;
   volatile gcrcnt_t refarray     : 1;
   gcofs_t srtptr;
   gclen_t len;
-  gc_meta *alloc_next;
-  gc_meta *volatile mark_next;
+  gc_meta *alloc_next;   /* Address order for the sweeper, allocation order before hand off */
 };
 
 #define REFARRAY_FLAG 1
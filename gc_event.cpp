@@ -0,0 +1,177 @@
+#include "gc_event.hpp"
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <atomic>
+#include <vector>
+
+typedef std::chrono::steady_clock event_clock;
+
+int gc_event_on;
+
+struct event_rec
+{
+  uint64_t ns;          /* Since gc_event_enable */
+  const char *name;
+  uint64_t arg;
+  uint32_t tid;
+  char ph;
+};
+
+/*
+ *  Rings are never freed. A thread that exits gives its ring
+ *  up for the next new thread, which matters for the mostly-
+ *  parallel marker, a new thread every cycle. Each record
+ *  carries its thread id, so a reused ring keeps its history.
+ */
+struct event_ring
+{
+  event_rec recs[GC_EVENT_RING];
+  std::atomic<uint64_t> head;     /* Events ever written */
+  std::atomic<int> in_use;
+  event_ring *next;
+};
+
+static std::atomic<event_ring *> rings;
+static std::atomic<uint32_t> next_tid;
+static std::atomic<const char *> thread_names[GC_EVENT_THREADS];
+static event_clock::time_point event_epoch;
+
+static char *dump_path;
+
+struct event_thread
+{
+  event_ring *ring;
+  uint32_t tid;
+
+  event_thread() : ring(0), tid(0) {}
+  ~event_thread() { if(ring) { ring->in_use.store(0, std::memory_order_release); } }
+};
+
+static thread_local event_thread event_self;
+
+static event_ring *ring_get()
+{
+  event_thread *self = &event_self;
+  if(self->ring) { return self->ring; }
+
+  self->tid = next_tid.fetch_add(1, std::memory_order_relaxed) + 1;
+  for(event_ring *ring = rings.load(std::memory_order_acquire); ring; ring = ring->next)
+  {
+    int idle = 0;
+    if(ring->in_use.compare_exchange_strong(idle, 1, std::memory_order_acquire))
+    { return self->ring = ring; }
+  }
+
+  event_ring *ring = new event_ring();
+  ring->head.store(0, std::memory_order_relaxed);
+  ring->in_use.store(1, std::memory_order_relaxed);
+  ring->next = rings.load(std::memory_order_relaxed);
+  while(!rings.compare_exchange_weak(ring->next, ring, std::memory_order_release,
+                                     std::memory_order_relaxed)) {}
+  return self->ring = ring;
+}
+
+static void dump_at_exit()
+{
+  if(gc_event_dump(dump_path)) { perror(dump_path); }
+}
+
+void gc_event_enable(const char *path)
+{
+  if(!gc_event_on) { event_epoch = event_clock::now(); }
+  gc_event_on = 1;
+
+  if(path && !dump_path)
+  {
+    dump_path = (char *)malloc(strlen(path) + 1);
+    strcpy(dump_path, path);
+    atexit(dump_at_exit);
+  }
+}
+
+void gc_event_name_thread(const char *name)
+{
+  ring_get();
+  if(event_self.tid < GC_EVENT_THREADS)
+  { thread_names[event_self.tid].store(name, std::memory_order_relaxed); }
+}
+
+void gc_event_put(int ph, const char *name, uint64_t arg)
+{
+  event_ring *ring = ring_get();
+  uint64_t head = ring->head.load(std::memory_order_relaxed);
+  event_rec *rec = &ring->recs[head % GC_EVENT_RING];
+
+  rec->ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            event_clock::now() - event_epoch).count();
+  rec->name = name;
+  rec->arg = arg;
+  rec->tid = event_self.tid;
+  rec->ph = (char)ph;
+  ring->head.store(head + 1, std::memory_order_release);
+}
+
+/*
+ *  Copies a ring out from under its writer. Whatever the
+ *  writer may have overwritten during the copy is dropped.
+ */
+static void ring_snapshot(event_ring *ring, std::vector<event_rec> &out)
+{
+  uint64_t head = ring->head.load(std::memory_order_acquire);
+  uint64_t first = head > GC_EVENT_RING ? head - GC_EVENT_RING : 0;
+  size_t base = out.size();
+
+  for(uint64_t i = first; i < head; i++) { out.push_back(ring->recs[i % GC_EVENT_RING]); }
+
+  std::atomic_thread_fence(std::memory_order_acquire);
+  uint64_t now = ring->head.load(std::memory_order_relaxed);
+  uint64_t safe = now >= GC_EVENT_RING ? now - GC_EVENT_RING + 1 : 0;
+  if(safe > first)
+  {
+    size_t drop = (size_t)((safe < head ? safe : head) - first);
+    out.erase(out.begin() + base, out.begin() + base + drop);
+  }
+}
+
+int gc_event_dump(const char *path)
+{
+  FILE *out = fopen(path, "w");
+  if(!out) { return -1; }
+
+  std::vector<event_rec> recs;
+  for(event_ring *ring = rings.load(std::memory_order_acquire); ring; ring = ring->next)
+  { ring_snapshot(ring, recs); }
+
+  fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  const char *sep = "";
+  for(uint32_t tid = 0; tid < GC_EVENT_THREADS; tid++)
+  {
+    const char *name = thread_names[tid].load(std::memory_order_relaxed);
+    if(!name) { continue; }
+    fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,"
+                 "\"args\":{\"name\":\"%s\"}}", sep, tid, name);
+    sep = ",\n";
+  }
+
+  for(size_t i = 0; i < recs.size(); i++)
+  {
+    event_rec *rec = &recs[i];
+    fprintf(out, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%u",
+            sep, rec->name, rec->ph, rec->ns / 1000.0, rec->tid);
+    if(rec->ph == GC_EVENT_COUNTER)
+    { fprintf(out, ",\"args\":{\"value\":%llu}", (unsigned long long)rec->arg); }
+    else if(rec->ph == GC_EVENT_INSTANT)
+    {
+      fprintf(out, ",\"s\":\"t\"");
+      if(rec->arg) { fprintf(out, ",\"args\":{\"value\":%llu}", (unsigned long long)rec->arg); }
+    }
+    fprintf(out, "}");
+    sep = ",\n";
+  }
+  fprintf(out, "\n]}\n");
+
+  return fclose(out) ? -1 : 0;
+}
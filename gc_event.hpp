@@ -0,0 +1,47 @@
+#ifndef GC_EVENT_HPP
+#define GC_EVENT_HPP
+
+/*
+ *  Collector timeline in Chrome trace event format.
+ *
+ *  Every thread writes its events into its own ring, without
+ *  locks: the owner fills a slot and then publishes it by
+ *  bumping the ring's head. Only the last GC_EVENT_RING events
+ *  of each thread are kept. gc_event_dump writes them all out
+ *  as JSON for chrome://tracing or ui.perfetto.dev, and runs on
+ *  its own at exit when enabled with a path. Events written
+ *  while dumping may be left out, never torn.
+ *
+ *  Names must be string literals, or at least outlive the
+ *  dump. Begin and end events nest per thread.
+ */
+
+#include <stdint.h>
+
+#define GC_EVENT_RING    (1 << 16)   /* Events kept per thread, a power of two */
+#define GC_EVENT_THREADS 256         /* Threads that can be named */
+
+#define GC_EVENT_BEGIN   'B'
+#define GC_EVENT_END     'E'
+#define GC_EVENT_INSTANT 'i'
+#define GC_EVENT_COUNTER 'C'
+
+extern int gc_event_on;
+
+void gc_event_enable(const char *dump_path);
+int  gc_event_dump(const char *path);
+void gc_event_name_thread(const char *name);
+void gc_event_put(int ph, const char *name, uint64_t arg);
+
+static inline void gc_event_begin(const char *name) { gc_event_put(GC_EVENT_BEGIN, name, 0); }
+static inline void gc_event_end(const char *name) { gc_event_put(GC_EVENT_END, name, 0); }
+
+/* Handshakes and other points in time. arg is shown when nonzero. */
+static inline void gc_event_instant(const char *name, uint64_t arg)
+{ gc_event_put(GC_EVENT_INSTANT, name, arg); }
+
+/* Heap size and other samples, drawn as a graph. */
+static inline void gc_event_counter(const char *name, uint64_t value)
+{ gc_event_put(GC_EVENT_COUNTER, name, value); }
+
+#endif
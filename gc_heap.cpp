@@ -0,0 +1,148 @@
+#include "gc_heap.hpp"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+static size_t heap_round(size_t sz)
+{ return (sz + GC_HEAP_ALIGN - 1) & ~(GC_HEAP_ALIGN - 1); }
+
+static int heap_drop(char *first, size_t sz);
+
+/*
+ *  Lets the sweeper clear reclaimed memory in bulk, so the
+ *  allocator never has to. The whole 2 MB pages of a big
+ *  range are handed back to the OS and fault back in as zero
+ *  pages, only the ragged ends get written. Dropping part of
+ *  a transparent huge page would split it, and the heap would
+ *  lose its huge page backing. Falls back to memset when the
+ *  pages can't be dropped (large pages on Windows).
+ */
+void gc_heap_zero(void *p, size_t sz)
+{
+  char *start = (char *)p, *end = start + sz;
+
+  if(sz >= GC_HEAP_ZERO_DROP)
+  {
+    char *first = (char *)(((uintptr_t)start + GC_HEAP_ALIGN - 1) & ~(uintptr_t)(GC_HEAP_ALIGN - 1));
+    char *last = (char *)((uintptr_t)end & ~(uintptr_t)(GC_HEAP_ALIGN - 1));
+
+    if(first < last && !heap_drop(first, last - first))
+    {
+      memset(start, 0, first - start);
+      memset(last, 0, end - last);
+      return;
+    }
+  }
+
+  memset(start, 0, sz);
+}
+
+void gc_heap_zero_add(gc_heap_run *run, void *p, size_t sz)
+{
+  if(run->end != (char *)p)
+  {
+    gc_heap_zero_flush(run);
+    run->start = (char *)p;
+  }
+  run->end = (char *)p + sz;
+}
+
+void gc_heap_zero_flush(gc_heap_run *run)
+{
+  if(run->end) { gc_heap_zero(run->start, run->end - run->start); }
+  run->start = run->end = 0;
+}
+
+#if defined(_WIN32)
+
+void *gc_heap_map(size_t sz, int flags)
+{
+  void *heap = 0;
+
+  /* Needs SeLockMemoryPrivilege. Quietly fall back without it. */
+  if((flags & GC_HEAP_HUGETLB) && GetLargePageMinimum())
+  {
+    heap = VirtualAlloc(0, heap_round(sz),
+                        MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES,
+                        PAGE_READWRITE);
+  }
+  if(!heap)
+  { heap = VirtualAlloc(0, sz, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE); }
+
+  return heap;
+}
+
+void gc_heap_unmap(void *heap, size_t sz)
+{
+  (void)sz;
+  VirtualFree(heap, 0, MEM_RELEASE);
+}
+
+/* Decommitted pages come back zeroed. Large pages refuse to decommit. */
+static int heap_drop(char *first, size_t sz)
+{
+  if(!VirtualFree(first, sz, MEM_DECOMMIT)) { return -1; }
+  return VirtualAlloc(first, sz, MEM_COMMIT, PAGE_READWRITE) ? 0 : -1;
+}
+
+#else
+
+void *gc_heap_map(size_t sz, int flags)
+{
+  sz = heap_round(sz);
+
+#ifdef MAP_HUGETLB
+  if(flags & GC_HEAP_HUGETLB)
+  {
+    void *heap = mmap(0, sz, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if(heap != MAP_FAILED) { return heap; }
+  }
+#endif
+
+  /*
+   *  Over-map by one huge page and trim both ends so the
+   *  heap starts on a 2 MB boundary. Otherwise the kernel
+   *  can't back the first and last partial huge pages.
+   */
+  char *raw = (char *)mmap(0, sz + GC_HEAP_ALIGN, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(raw == (char *)MAP_FAILED) { return 0; }
+
+  char *heap = (char *)(((uintptr_t)raw + GC_HEAP_ALIGN - 1) & ~(GC_HEAP_ALIGN - 1));
+  if(heap != raw) { munmap(raw, heap - raw); }
+  munmap(heap + sz, raw + GC_HEAP_ALIGN - heap);
+
+#if defined(MADV_HUGEPAGE) && defined(MADV_NOHUGEPAGE)
+  madvise(heap, sz, flags & GC_HEAP_SMALL ? MADV_NOHUGEPAGE : MADV_HUGEPAGE);
+#endif
+
+  return heap;
+}
+
+void gc_heap_unmap(void *heap, size_t sz)
+{ munmap(heap, heap_round(sz)); }
+
+/* Private anonymous pages read back as zero after MADV_DONTNEED. */
+static int heap_drop(char *first, size_t sz)
+{ return madvise(first, sz, MADV_DONTNEED); }
+
+#endif
+
+/* GC_HEAP_PAGES=hugetlb|small|thp */
+int gc_heap_env_flags()
+{
+  const char *pages = getenv("GC_HEAP_PAGES");
+
+  if(!pages) { return 0; }
+  if(!strcmp(pages, "hugetlb")) { return GC_HEAP_HUGETLB; }
+  if(!strcmp(pages, "small")) { return GC_HEAP_SMALL; }
+  return 0;
+}
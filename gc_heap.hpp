@@ -0,0 +1,44 @@
+#ifndef GC_HEAP_HPP
+#define GC_HEAP_HPP
+
+/*
+ *  Maps collector heaps (and their side metadata) so
+ *  they can be backed by 2 MB pages. Marking and sweeping
+ *  a big heap with 4 KB pages spends its time in TLB misses.
+ *
+ *  By default the region is 2 MB aligned and advised as
+ *  transparent huge page memory. GC_HEAP_HUGETLB tries the
+ *  reserved huge page pool first (MAP_HUGETLB, or large
+ *  pages on Windows) and falls back to the default.
+ *  GC_HEAP_SMALL asks for plain 4 KB pages, for comparison.
+ */
+
+#include <stddef.h>
+
+#define GC_HEAP_ALIGN   ((size_t)2 << 20)
+
+#define GC_HEAP_HUGETLB 1
+#define GC_HEAP_SMALL   2
+
+/* gc_heap_zero gives whole 2 MB pages back instead of clearing ranges this big. */
+#define GC_HEAP_ZERO_DROP GC_HEAP_ALIGN
+
+/*
+ *  Sweeps hand freed ranges to gc_heap_zero_add as they go,
+ *  so adjacent ones are cleared as one and a big enough run
+ *  can give its pages back. gc_heap_zero_flush clears what
+ *  is left, before the memory is handed out again.
+ */
+struct gc_heap_run
+{
+  char *start, *end;
+};
+
+void *gc_heap_map(size_t sz, int flags);
+void gc_heap_unmap(void *heap, size_t sz);
+void gc_heap_zero(void *p, size_t sz);
+void gc_heap_zero_add(gc_heap_run *run, void *p, size_t sz);
+void gc_heap_zero_flush(gc_heap_run *run);
+int gc_heap_env_flags();
+
+#endif
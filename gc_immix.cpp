@@ -0,0 +1,561 @@
+#include "gc_immix.hpp"
+#include "gc_heap.hpp"
+#include "gc_root.hpp"
+#include "gc_mark.hpp"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+
+struct gc_tree
+{
+  gc_tree *parent;
+  gc_tree *children;
+  gc_tree *next;
+  void *data;
+};
+
+static const size_t heap_sz = 1 << 30;
+#define BLOCK_SZ   (32 * 1024)
+#define LINE_SZ    128
+#define LINES      (BLOCK_SZ / LINE_SZ)
+#define NBLOCKS    (heap_sz / BLOCK_SZ)
+#define MAX_MEDIUM (BLOCK_SZ / 4)   /* Bigger goes to the large object space */
+
+gclen_t strong_table[] =
+{
+  /* No children */
+  0,
+
+  /* gc_tree */
+  4,
+  0, sizeof(void *), 2 * sizeof(void *), 3 * sizeof(void *)
+};
+
+#define BLOCK_FREE       0
+#define BLOCK_RECYCLABLE 1   /* Some free lines left after the last trace */
+#define BLOCK_USED       2
+
+struct gc_block
+{
+  uint16_t live_lines;   /* As of the last trace */
+  uint8_t state;
+  uint8_t candidate;     /* Evacuate this cycle */
+};
+
+/*
+ *  Large objects are malloc'd and never move. They are
+ *  calloc'd rather than cleared in the sweep, since free()
+ *  gives the memory back to malloc, and fresh chunks come
+ *  zeroed without a memset.
+ */
+struct gc_large
+{
+  gc_large *next;
+  gclen_t pad;
+  /* gc_meta follows */
+};
+
+static char *heap;
+static gc_block *blocks;
+static uint8_t *line_marks;         /* LINES per block, side table */
+static uint8_t *line_dirty;         /* Handed out since the sweep last cleared it */
+static uint8_t *line_first;         /* First object starting in the line, in align_t plus one, 0 if none */
+static size_t blocks_hwm;           /* Blocks ever handed out */
+static size_t block_cursor;
+static size_t *recyc;
+static size_t nrecyc;
+
+static gc_large *large;
+
+/* Mutator allocation: the current hole, plus a block for medium objects. */
+static char *cursor, *limit;
+static size_t alloc_block;
+static int alloc_line;
+static char *ovf_cursor, *ovf_limit;
+
+/* Evacuation target during a trace. */
+static char *copy_cursor, *copy_limit;
+static size_t copy_budget;
+
+static int mark_epoch;
+
+/*
+ *  Mapped once in gc_init, marking never allocates. An object
+ *  that finds the stack full is left pending and picked up by
+ *  walking the marked lines after the drain.
+ */
+#define MARK_STACK_SZ ((size_t)1 << 20)
+static gc_mark_stack mark_stack;
+
+static gc_root_table roots;
+
+#define MIN_TRIGGER (8 << 20)
+#define SPARSE      (LINES / 4)
+#define HEADROOM    (NBLOCKS / 32)
+static gclen_t live_bytes;
+static gclen_t alloc_bytes;
+
+void gc_init()
+{
+  heap = (char *)gc_heap_map(heap_sz, gc_heap_env_flags());
+  blocks = (gc_block *)gc_heap_map(NBLOCKS * sizeof(gc_block), 0);
+  line_marks = (uint8_t *)gc_heap_map(NBLOCKS * LINES, 0);
+  line_dirty = (uint8_t *)gc_heap_map(NBLOCKS * LINES, 0);
+  line_first = (uint8_t *)gc_heap_map(NBLOCKS * LINES, 0);
+  recyc = (size_t *)gc_heap_map(NBLOCKS * sizeof(size_t), 0);
+  assert(heap && blocks && line_marks && line_dirty && line_first && recyc);
+  gc_mark_init(&mark_stack, gc_heap_map(MARK_STACK_SZ, 0), MARK_STACK_SZ);
+
+  gc_root_init(&roots, 1024);
+
+  alloc_block = NBLOCKS;
+  mark_epoch = 0;
+}
+
+/* ---------------------------- Allocation ---------------------------- */
+
+static char *block_base(size_t b)
+{ return heap + b * BLOCK_SZ; }
+
+static int in_heap(void *p)
+{ return (char *)p >= heap && (char *)p < heap + heap_sz; }
+
+static size_t block_of(void *p)
+{ return ((char *)p - heap) / BLOCK_SZ; }
+
+/* Objects go in a line in address order, so the first one noted stays. */
+static void note_start(gc_meta *meta)
+{
+  size_t off = (char *)meta - heap;
+  uint8_t *first = line_first + off / LINE_SZ;
+  if(!*first) { *first = (uint8_t)(off % LINE_SZ / sizeof(align_t) + 1); }
+}
+
+static size_t block_take_free()
+{
+  for(size_t scanned = 0; scanned < NBLOCKS; scanned++)
+  {
+    size_t b = block_cursor;
+    block_cursor = (block_cursor + 1) % NBLOCKS;
+
+    if(blocks[b].state == BLOCK_FREE)
+    {
+      /* Counts as full until traced, so it isn't picked for evacuation. */
+      blocks[b].state = BLOCK_USED;
+      blocks[b].live_lines = LINES;
+      memset(line_marks + b * LINES, 0, LINES);
+      memset(line_dirty + b * LINES, 1, LINES);
+      if(b + 1 > blocks_hwm) { blocks_hwm = b + 1; }
+      return b;
+    }
+  }
+  return NBLOCKS;
+}
+
+/* Next run of free lines, recyclable blocks first. */
+static int next_hole()
+{
+  while(1)
+  {
+    if(alloc_block < NBLOCKS)
+    {
+      uint8_t *marks = line_marks + alloc_block * LINES;
+      while(alloc_line < LINES && marks[alloc_line]) { alloc_line++; }
+
+      int start = alloc_line;
+      while(alloc_line < LINES && !marks[alloc_line]) { alloc_line++; }
+
+      if(start < LINES)
+      {
+        memset(line_dirty + alloc_block * LINES + start, 1, alloc_line - start);
+        cursor = block_base(alloc_block) + start * LINE_SZ;
+        limit = block_base(alloc_block) + alloc_line * LINE_SZ;
+        return 1;
+      }
+    }
+
+    if(nrecyc)
+    {
+      alloc_block = recyc[--nrecyc];
+      blocks[alloc_block].state = BLOCK_USED;
+    }
+    else if((alloc_block = block_take_free()) == NBLOCKS) { return 0; }
+    alloc_line = 0;
+  }
+}
+
+static gc_meta *immix_alloc(gclen_t true_len)
+{
+  if(cursor + true_len <= limit)
+  {
+    gc_meta *retmeta = (gc_meta *)cursor;
+    cursor += true_len;
+    return retmeta;
+  }
+
+  /* Medium objects skip small holes and go to the overflow block. */
+  if(true_len > LINE_SZ)
+  {
+    if(ovf_cursor + true_len > ovf_limit)
+    {
+      size_t b = block_take_free();
+      if(b == NBLOCKS) { return 0; }
+      ovf_cursor = block_base(b);
+      ovf_limit = ovf_cursor + BLOCK_SZ;
+    }
+    gc_meta *retmeta = (gc_meta *)ovf_cursor;
+    ovf_cursor += true_len;
+    return retmeta;
+  }
+
+  while(next_hole())
+  {
+    if(cursor + true_len <= limit)
+    {
+      gc_meta *retmeta = (gc_meta *)cursor;
+      cursor += true_len;
+      return retmeta;
+    }
+  }
+  return 0;
+}
+
+static gc_meta *large_alloc(gclen_t true_len)
+{
+  gc_large *obj = (gc_large *)calloc(1, sizeof(gc_large) + true_len);
+  if(!obj) { return 0; }
+  obj->next = large;
+  large = obj;
+  return (gc_meta *)(obj + 1);
+}
+
+void *gc_create_ref(gclen_t len, gclen_t srtptr, int flags)
+{
+  gclen_t true_len = (len + sizeof(gc_meta) + sizeof(align_t) - 1) &
+                     ~(sizeof(align_t) - 1);
+  int is_large = true_len > MAX_MEDIUM;
+
+  if(alloc_bytes >= MIN_TRIGGER && alloc_bytes >= live_bytes) { gc_trace(); }
+
+  gc_meta *retmeta = is_large ? large_alloc(true_len) : immix_alloc(true_len);
+  if(!retmeta && !is_large)
+  {
+    gc_trace();
+    if(!(retmeta = immix_alloc(true_len))) { return 0; }
+  }
+  if(!retmeta) { return 0; }
+  if(!is_large) { note_start(retmeta); }
+
+  retmeta->srtptr = srtptr;
+  retmeta->refarray = flags & REFARRAY_FLAG ? 1 : 0;
+  retmeta->mark = mark_epoch;    /* Reads as unmarked once the next trace flips */
+  retmeta->forwarded = 0;
+  retmeta->rooted = 0;
+  retmeta->pending = 0;
+  retmeta->len = true_len;
+  alloc_bytes += true_len;
+
+  if(flags & ROOT_FLAG) { gc_inc_rrcnt(retmeta + 1); }
+  return retmeta + 1;
+}
+
+void gc_dec_rrcnt(void *alloc)
+{
+  gc_meta *retmeta = ((gc_meta *)alloc) - 1;
+  if(!alloc || !retmeta->rooted) { return; }
+
+  gc_root *entry = gc_root_find(&roots, retmeta);
+  if(--entry->rrcnt <= 0)
+  {
+    gc_root_remove(&roots, entry);
+    retmeta->rooted = 0;
+  }
+}
+
+void gc_inc_rrcnt(void *alloc)
+{
+  gc_meta *retmeta = ((gc_meta *)alloc) - 1;
+  if(!alloc) { return; }
+
+  gc_root *entry = retmeta->rooted ? gc_root_find(&roots, retmeta) : gc_root_insert(&roots, retmeta);
+  entry->rrcnt++;
+  retmeta->rooted = 1;
+}
+
+/* ------------------------------ Tracing ----------------------------- */
+
+static gc_meta *copy_alloc(gclen_t len)
+{
+  if(copy_cursor + len > copy_limit)
+  {
+    if(!copy_budget) { return 0; }
+    size_t b = block_take_free();
+    if(b == NBLOCKS) { return 0; }
+    copy_budget--;
+    copy_cursor = block_base(b);
+    copy_limit = copy_cursor + BLOCK_SZ;
+  }
+
+  gc_meta *retmeta = (gc_meta *)copy_cursor;
+  copy_cursor += len;
+  return retmeta;
+}
+
+static void mark_lines(gc_meta *meta)
+{
+  gclen_t first = ((char *)meta - heap) / LINE_SZ;
+  gclen_t last = ((char *)meta + meta->len - 1 - heap) / LINE_SZ;
+  memset(line_marks + first, 1, last - first + 1);
+}
+
+static void trace_slot(gc_mark_stack *stack, void **slot);
+
+static void mark_children(gc_mark_stack *stack, void *obj)
+{
+  gc_meta *current = (gc_meta *)obj;
+  current->pending = 0;
+
+  if(current->refarray)
+  {
+    void **children = (void **)(current + 1);
+    for(gclen_t i = 0; i < current->srtptr; i++)
+    {
+      if(children[i]) { trace_slot(stack, &children[i]); }
+    }
+  }
+  else
+  {
+    gclen_t nchildren = strong_table[current->srtptr];
+    char *base = (char *)(current + 1);
+    for(gclen_t i = current->srtptr + 1; nchildren--; i++)
+    {
+      void **slot = (void **)(base + strong_table[i]);
+      if(*slot) { trace_slot(stack, slot); }
+    }
+  }
+}
+
+static void mark_object(gc_mark_stack *stack, gc_meta *meta)
+{
+  meta->mark = mark_epoch;
+  if(in_heap(meta)) { mark_lines(meta); }
+  if(!gc_mark_push(stack, meta)) { meta->pending = 1; }
+}
+
+/* Marks what a slot refers to, evacuating it out of a sparse block. */
+static void trace_slot(gc_mark_stack *stack, void **slot)
+{
+  gc_meta *meta = (gc_meta *)*slot - 1;
+
+  if(meta->forwarded)
+  {
+    *slot = (gc_meta *)(uintptr_t)meta->srtptr + 1;
+    return;
+  }
+  if(meta->mark == (gclen_t)mark_epoch) { return; }
+
+  if(in_heap(meta) && blocks[block_of(meta)].candidate && !meta->rooted)
+  {
+    gc_meta *copy = copy_alloc(meta->len);
+    if(copy)
+    {
+      memcpy(copy, meta, meta->len);
+      note_start(copy);
+      meta->forwarded = 1;
+      meta->srtptr = (gclen_t)(uintptr_t)copy;
+      *slot = copy + 1;
+      meta = copy;
+    }
+  }
+
+  mark_object(stack, meta);
+}
+
+/*
+ *  The rescan after an overflow: pending objects in the lines
+ *  this trace marked, parsed from the first object starting
+ *  in each, then the large objects. The objects in a marked
+ *  line were all placed in one go, so they parse as a run,
+ *  and their headers are intact, dead or not.
+ */
+static void *mark_next_pending(void *obj)
+{
+  gc_meta *meta = (gc_meta *)obj;
+  gc_large *big = large;
+
+  if(!meta || in_heap(meta))
+  {
+    size_t line = meta ? ((char *)meta - heap) / LINE_SZ : 0;
+    char *p = meta ? (char *)meta + meta->len : 0;
+
+    for(; line < blocks_hwm * LINES; line++, p = 0)
+    {
+      if(!line_marks[line] || !line_first[line]) { continue; }
+
+      char *base = heap + line * LINE_SZ;
+      if(!p) { p = base + (line_first[line] - 1) * sizeof(align_t); }
+      for(gc_meta *next; p < base + LINE_SZ && (next = (gc_meta *)p)->len; p += next->len)
+      {
+        if(next->pending) { return next; }
+      }
+    }
+  }
+  else { big = ((gc_large *)meta - 1)->next; }
+
+  for(; big; big = big->next)
+  {
+    gc_meta *next = (gc_meta *)(big + 1);
+    if(next->pending) { return next; }
+  }
+  return 0;
+}
+
+static const gc_mark_heap mark_heap = { mark_children, mark_next_pending, 0 };
+
+/*
+ *  Picks sparse blocks while there is room to copy
+ *  their survivors into free blocks.
+ */
+static void select_candidates()
+{
+  size_t nfree = NBLOCKS - blocks_hwm;
+  for(size_t b = 0; b < blocks_hwm; b++)
+  {
+    if(blocks[b].state == BLOCK_FREE) { nfree++; }
+  }
+
+  copy_budget = nfree < HEADROOM ? nfree / 2 : HEADROOM;
+  gclen_t room = copy_budget * LINES;
+
+  for(size_t b = 0; b < blocks_hwm; b++)
+  {
+    gc_block *block = &blocks[b];
+    block->candidate = 0;
+
+    if(block->state != BLOCK_FREE && block->live_lines <= SPARSE &&
+       block->live_lines <= room)
+    {
+      block->candidate = 1;
+      room -= block->live_lines;
+    }
+  }
+}
+
+/*
+ *  Free lines are kept zeroed, so allocation needn't clear
+ *  them. Lines handed out since the last sweep that came out
+ *  unmarked are cleared here, adjacent ones as one run.
+ */
+static void sweep_zero(size_t b, gc_heap_run *dead)
+{
+  uint8_t *marks = line_marks + b * LINES;
+  uint8_t *dirty = line_dirty + b * LINES;
+
+  for(int i = 0; i < LINES; i++)
+  {
+    if(marks[i] || !dirty[i]) { continue; }
+    dirty[i] = 0;
+    line_first[b * LINES + i] = 0;
+    gc_heap_zero_add(dead, block_base(b) + i * LINE_SZ, LINE_SZ);
+  }
+}
+
+static void sweep()
+{
+  gclen_t local_live = 0;
+  gc_heap_run dead = { 0, 0 };
+  nrecyc = 0;
+
+  for(size_t b = 0; b < blocks_hwm; b++)
+  {
+    gc_block *block = &blocks[b];
+    if(block->state == BLOCK_FREE) { continue; }
+
+    uint8_t *marks = line_marks + b * LINES;
+    uint16_t nlive = 0;
+    for(int i = 0; i < LINES; i++) { nlive += marks[i]; }
+
+    block->live_lines = nlive;
+    block->candidate = 0;
+    sweep_zero(b, &dead);
+    if(!nlive) { block->state = BLOCK_FREE; }
+    else if(nlive < LINES)
+    {
+      block->state = BLOCK_RECYCLABLE;
+      recyc[nrecyc++] = b;
+    }
+    else { block->state = BLOCK_USED; }
+    local_live += nlive * LINE_SZ;
+  }
+
+  gc_heap_zero_flush(&dead);
+
+  gc_large **link = &large;
+  while(*link)
+  {
+    gc_large *obj = *link;
+    gc_meta *meta = (gc_meta *)(obj + 1);
+
+    if(meta->mark == (gclen_t)mark_epoch)
+    {
+      local_live += meta->len;
+      link = &obj->next;
+    }
+    else
+    {
+      *link = obj->next;
+      free(obj);
+    }
+  }
+
+  live_bytes = local_live;
+  alloc_bytes = 0;
+}
+
+void gc_trace()
+{
+  mark_epoch ^= 1;
+  memset(line_marks, 0, blocks_hwm * LINES);
+  select_candidates();
+  copy_cursor = copy_limit = 0;
+
+  /* Roots are pinned, so they are marked in place. */
+  for(gclen_t i = 0; i <= roots.mask; i++)
+  {
+    gc_meta *meta = (gc_meta *)roots.roots[i].obj;
+    if(!meta || meta->mark == (gclen_t)mark_epoch) { continue; }
+
+    mark_object(&mark_stack, meta);
+    gc_mark_drain(&mark_stack, &mark_heap);
+  }
+  gc_mark_finish(&mark_stack, &mark_heap);
+
+  sweep();
+
+  /* Line marks changed under the allocator, so start over. */
+  cursor = limit = 0;
+  ovf_cursor = ovf_limit = 0;
+  alloc_block = NBLOCKS;
+}
+
+int main()
+{
+  gc_init();
+
+  while(1)
+  {
+    /* Unrooted objects may move, so reach them through root. */
+    gc_tree *root = (gc_tree *)gc_create_ref(sizeof (gc_tree), 1, ROOT_FLAG);
+    gc_tree *child = (gc_tree *)gc_create_ref(sizeof (gc_tree), 1, 0);
+    root->children = child;
+    root->children->parent = root;
+    child = (gc_tree *)gc_create_ref(sizeof (gc_tree), 1, 0);
+    root->children->next = child;
+    root->children->next->parent = root;
+    gc_dec_rrcnt(root);
+    printf("%p\r\n", (void *)root);
+  }
+  return 0;
+}
@@ -0,0 +1,41 @@
+#ifndef GC_IMMIX_HPP
+#define GC_IMMIX_HPP
+
+/*
+ *  Immix-style mark-region collector. Same interface as
+ *  gc_stwtrace. The heap is 32 KB blocks of 128-byte lines;
+ *  the mutator bump allocates into runs of free lines and
+ *  the tracer opportunistically evacuates sparse blocks.
+ *
+ *  Rooted objects are pinned. Anything else may move during
+ *  gc_trace, so only hold on to it through a rooted object.
+ */
+
+#include <stdint.h>
+
+typedef int64_t gcrcnt_t;
+typedef uint64_t gclen_t;
+typedef uint64_t align_t;
+
+struct gc_meta
+{
+  gclen_t srtptr    : 56;   /* Strong table index, or # of refs for arrays */
+  gclen_t refarray  : 1;
+  gclen_t mark      : 1;    /* Marked when equal to the collector's epoch */
+  gclen_t forwarded : 1;    /* Evacuated, srtptr holds the new header */
+  gclen_t rooted    : 1;    /* Has a root table entry, never moves */
+  gclen_t pending   : 1;    /* Marked, children left unscanned by a full mark stack */
+  gclen_t           : 3;
+  gclen_t len;
+};
+
+#define ROOT_FLAG     1
+#define REFARRAY_FLAG 2
+
+void gc_init();
+void *gc_create_ref(gclen_t len, gclen_t srtptr, int flags);
+void gc_dec_rrcnt(void *alloc);
+void gc_inc_rrcnt(void *alloc);
+void gc_trace();
+
+#endif
@@ -0,0 +1,26 @@
+#include "gc_limit.hpp"
+
+uint64_t gc_limit_soft;
+uint64_t gc_limit_budget;
+uint64_t gc_limit_nbytes;
+gc_low_memory_fn gc_limit_low_memory;
+
+void gc_limit_pace()
+{
+  uint64_t used = gc_limit_collector.used();
+  uint64_t min_budget = gc_limit_collector.min_budget;
+  uint64_t room = used < gc_limit_soft ? gc_limit_soft - used : 0;
+  gc_limit_budget = room / 2 > min_budget ? room / 2 : min_budget;
+  gc_limit_nbytes = 0;
+}
+
+void gc_on_low_memory(gc_low_memory_fn fn)
+{
+  gc_limit_low_memory = fn;
+}
+
+void gc_set_soft_limit(uint64_t bytes)
+{
+  gc_limit_soft = bytes;
+  gc_limit_pace();
+}
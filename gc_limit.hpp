@@ -0,0 +1,68 @@
+#ifndef GC_LIMIT_HPP
+#define GC_LIMIT_HPP
+
+/*
+ *  Soft heap limit and the low-memory retry, shared by the
+ *  collectors.
+ *
+ *  After each collection the mutator may allocate half the
+ *  room left under the limit, but at least the collector's
+ *  minimum budget, before the next one, so collections come
+ *  faster as the heap fills up. The collector defines
+ *  gc_limit_collector, counts what it hands out
+ *  (gc_limit_alloc), collects once gc_limit_due says so and
+ *  calls gc_limit_pace afterwards.
+ */
+
+#include <stdint.h>
+
+/*
+ *  Called when an allocation of `need` bytes still fails after
+ *  a full collection. Drop what references you can and return
+ *  nonzero to have the collection and allocation retried.
+ *  It must not allocate. After that the allocation returns 0.
+ */
+typedef int (*gc_low_memory_fn)(uint64_t need);
+void gc_on_low_memory(gc_low_memory_fn fn);
+
+/* 0 turns the limit off. */
+void gc_set_soft_limit(uint64_t bytes);
+
+struct gc_limit_ops
+{
+  uint64_t min_budget;
+  uint64_t (*used)();            /* Bytes in use right after a collection */
+};
+
+/* Defined by the collector linked in. */
+extern const gc_limit_ops gc_limit_collector;
+
+void gc_limit_pace();
+
+extern uint64_t gc_limit_soft;
+extern uint64_t gc_limit_budget;
+extern uint64_t gc_limit_nbytes;       /* Allocated since the last collection */
+extern gc_low_memory_fn gc_limit_low_memory;
+
+static inline void gc_limit_alloc(uint64_t len)
+{
+  gc_limit_nbytes += len;
+}
+
+static inline int gc_limit_due()
+{
+  return gc_limit_soft && gc_limit_nbytes >= gc_limit_budget;
+}
+
+/*
+ *  Allocation failed. Round 0 collects everything, round 1
+ *  does it again if the low-memory callback let go of
+ *  something. Returns 0 once there is nothing left to try.
+ */
+static inline int gc_limit_retry(int round, uint64_t need)
+{
+  if(round == 0) { return 1; }
+  return round == 1 && gc_limit_low_memory && gc_limit_low_memory(need);
+}
+
+#endif
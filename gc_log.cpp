@@ -0,0 +1,53 @@
+#include "gc_log.hpp"
+
+#include <string.h>
+#include <stdlib.h>
+
+/* The header isn't copied, pass a string that stays around. */
+void gc_log_init(gc_log *log, const char *path, const char *header, long max, int keep)
+{
+  if(log->path) { return; }
+
+  log->path = (char *)malloc(strlen(path) + 1);
+  strcpy(log->path, path);
+  log->header = header;
+  log->max = max;
+  log->keep = keep;
+  log->file = 0;
+}
+
+/* Shifts path.N-1 to path.N, ..., path to path.1, then starts a fresh file. */
+static void log_rotate(gc_log *log)
+{
+  size_t sz = strlen(log->path) + 16;
+  char *from = (char *)malloc(sz), *to = (char *)malloc(sz);
+
+  if(log->file) { fclose(log->file); }
+  for(int i = log->keep - 1; i > 0; i--)
+  {
+    snprintf(from, sz, "%s.%d", log->path, i);
+    snprintf(to, sz, "%s.%d", log->path, i + 1);
+    rename(from, to);
+  }
+  snprintf(to, sz, "%s.1", log->path);
+  rename(log->path, to);
+
+  log->file = fopen(log->path, "w");
+  if(log->file) { fputs(log->header, log->file); }
+
+  free(from);
+  free(to);
+}
+
+/* The file to write the next record to, 0 if it can't be opened. */
+FILE *gc_log_file(gc_log *log)
+{
+  if(!log->file)
+  {
+    log->file = fopen(log->path, "a");
+    if(log->file) { fseek(log->file, 0, SEEK_END); }
+    if(log->file && ftell(log->file) == 0) { fputs(log->header, log->file); }
+  }
+  if(log->file && ftell(log->file) >= log->max) { log_rotate(log); }
+  return log->file;
+}
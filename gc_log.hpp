@@ -0,0 +1,27 @@
+#ifndef GC_LOG_HPP
+#define GC_LOG_HPP
+
+/*
+ *  Rotating log file, shared by the census and counter logs.
+ *
+ *  The file is opened for append the first time it is written
+ *  to, so runs add to the same log, and the header only goes
+ *  on a new file. Past max bytes it is shifted to path.1, the
+ *  older ones along up to path.keep, and a new file started.
+ */
+
+#include <stdio.h>
+
+struct gc_log
+{
+  char *path;               /* 0 if not logging */
+  const char *header;
+  long max;
+  int keep;
+  FILE *file;
+};
+
+void gc_log_init(gc_log *log, const char *path, const char *header, long max, int keep);
+FILE *gc_log_file(gc_log *log);
+
+#endif
@@ -0,0 +1,76 @@
+#include "gc_mark.hpp"
+
+#include <stdint.h>
+
+size_t gc_mark_init(gc_mark_stack *stack, void *mem, size_t bytes)
+{
+  uintptr_t start = ((uintptr_t)mem + sizeof(void *) - 1) & ~(uintptr_t)(sizeof(void *) - 1);
+  char *p = (char *)start;
+
+  bytes = bytes > start - (uintptr_t)mem ? bytes - (start - (uintptr_t)mem) : 0;
+  stack->top = 0;
+  stack->spare = 0;
+  stack->nsegments = 0;
+  stack->overflowed = 0;
+
+  for(; bytes >= sizeof(gc_mark_segment); bytes -= sizeof(gc_mark_segment))
+  {
+    gc_mark_segment *seg = (gc_mark_segment *)p;
+    seg->len = 0;
+    seg->next = stack->spare;
+    stack->spare = seg;
+    stack->nsegments++;
+    p += sizeof(gc_mark_segment);
+  }
+  return stack->nsegments;
+}
+
+/* Drops whatever is left, for a collector that gave up on its mark. */
+void gc_mark_reset(gc_mark_stack *stack)
+{
+  while(stack->top)
+  {
+    stack->top->len = 0;
+    gc_mark_pop_segment(stack);
+  }
+  stack->overflowed = 0;
+}
+
+int gc_mark_push_segment(gc_mark_stack *stack, void *obj)
+{
+  gc_mark_segment *seg = stack->spare;
+  if(!seg)
+  {
+    stack->overflowed = 1;
+    return 0;
+  }
+
+  stack->spare = seg->next;
+  seg->next = stack->top;
+  seg->entries[0] = obj;
+  seg->len = 1;
+  stack->top = seg;
+  return 1;
+}
+
+void gc_mark_pop_segment(gc_mark_stack *stack)
+{
+  gc_mark_segment *seg = stack->top;
+  stack->top = seg->next;
+  seg->next = stack->spare;
+  stack->spare = seg;
+}
+
+void gc_mark_finish(gc_mark_stack *stack, const gc_mark_heap *heap)
+{
+  gc_mark_drain(stack, heap);
+  while(stack->overflowed && !gc_mark_stopped(heap))
+  {
+    stack->overflowed = 0;
+    for(void *obj = heap->next_marked(0); obj && !gc_mark_stopped(heap); obj = heap->next_marked(obj))
+    {
+      heap->scan(stack, obj);
+      gc_mark_drain(stack, heap);
+    }
+  }
+}
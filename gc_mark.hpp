@@ -0,0 +1,95 @@
+#ifndef GC_MARK_HPP
+#define GC_MARK_HPP
+
+/*
+ *  Mark stack for the tracing collectors.
+ *
+ *  The collector hands over memory for the stack once, when
+ *  it starts. It is cut into segments of GC_MARK_SEGMENT
+ *  entries that are chained on as the stack grows and go back
+ *  on the spare list as it shrinks, so marking never calls
+ *  the allocator and the same segments serve every root and
+ *  every cycle.
+ *
+ *  Collectors mark an object before pushing it. Once every
+ *  segment is full a push is dropped and the stack is flagged
+ *  as overflowed, so the object stays marked with its children
+ *  unscanned. gc_mark_finish drains the stack, then walks the
+ *  heap and rescans the children of every marked object, until
+ *  a walk ends without overflowing again.
+ */
+
+#include <stddef.h>
+
+#define GC_MARK_SEGMENT 1024     /* Entries per segment */
+
+struct gc_mark_segment
+{
+  gc_mark_segment *next;         /* Below on the stack, or the next spare */
+  size_t len;
+  void *entries[GC_MARK_SEGMENT];
+};
+
+struct gc_mark_stack
+{
+  gc_mark_segment *top;          /* 0 when empty */
+  gc_mark_segment *spare;
+  size_t nsegments;
+  int overflowed;                /* A push was dropped since the collector last cleared this */
+};
+
+/* Returns the number of segments cut from mem, 0 if not even one fits. */
+size_t gc_mark_init(gc_mark_stack *stack, void *mem, size_t bytes);
+void   gc_mark_reset(gc_mark_stack *stack);
+
+int  gc_mark_push_segment(gc_mark_stack *stack, void *obj);
+void gc_mark_pop_segment(gc_mark_stack *stack);
+
+static inline int gc_mark_empty(const gc_mark_stack *stack) { return !stack->top; }
+
+/* Returns 0, and flags the overflow, if there was no room left. */
+static inline int gc_mark_push(gc_mark_stack *stack, void *obj)
+{
+  gc_mark_segment *top = stack->top;
+  if(top && top->len < GC_MARK_SEGMENT)
+  {
+    top->entries[top->len++] = obj;
+    return 1;
+  }
+  return gc_mark_push_segment(stack, obj);
+}
+
+/* The stack must not be empty. */
+static inline void *gc_mark_pop(gc_mark_stack *stack)
+{
+  gc_mark_segment *top = stack->top;
+  void *obj = top->entries[--top->len];
+  if(!top->len) { gc_mark_pop_segment(stack); }
+  return obj;
+}
+
+/*
+ *  The collector's side of a mark. scan marks and pushes the
+ *  unmarked children of obj. next_marked walks the heap for
+ *  the rescan: the first marked object when given 0, the next
+ *  one after obj otherwise. When stop is set and turns nonzero
+ *  the mark ends early, leaving the rest on the stack.
+ */
+struct gc_mark_heap
+{
+  void  (*scan)(gc_mark_stack *stack, void *obj);
+  void *(*next_marked)(void *obj);
+  volatile int *stop;
+};
+
+static inline int gc_mark_stopped(const gc_mark_heap *heap) { return heap->stop && *heap->stop; }
+
+static inline void gc_mark_drain(gc_mark_stack *stack, const gc_mark_heap *heap)
+{
+  while(!gc_mark_empty(stack) && !gc_mark_stopped(heap))
+  { heap->scan(stack, gc_mark_pop(stack)); }
+}
+
+void gc_mark_finish(gc_mark_stack *stack, const gc_mark_heap *heap);
+
+#endif
@@ -0,0 +1,247 @@
+#include "gc_perf.hpp"
+#include "gc_log.hpp"
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <mutex>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+typedef std::chrono::steady_clock perf_clock;
+
+int gc_perf_on;
+
+const char *gc_perf_phase_names[GC_PERF_PHASES] = { "clear", "mark", "sweep" };
+
+static std::mutex perf_mutex;
+static gc_perf_phase perf_now[GC_PERF_PHASES];
+static gc_perf_phase perf_last[GC_PERF_PHASES];   /* Last completed cycle */
+static uint64_t perf_ncycles;
+
+static gc_log perf_log;
+
+/*
+ *  One group per thread, read in a single call. Counters are
+ *  left running, a phase is the difference of two reads.
+ *  Closed when the thread exits, the mostly-parallel marker
+ *  gets a new thread every cycle.
+ */
+struct perf_thread
+{
+  int opened;
+  int leader;                      /* -1 if no counter opened */
+  int slot[GC_PERF_EVENTS];        /* Position in the group read, -1 if not open */
+  int fd[GC_PERF_EVENTS];
+  perf_clock::time_point start;
+  int64_t start_count[GC_PERF_EVENTS];
+
+  perf_thread() : opened(0), leader(-1)
+  {
+    for(int i = 0; i < GC_PERF_EVENTS; i++) { slot[i] = fd[i] = -1; }
+  }
+
+  ~perf_thread()
+  {
+#ifdef __linux__
+    for(int i = 0; i < GC_PERF_EVENTS; i++) { if(fd[i] >= 0) { close(fd[i]); } }
+#endif
+  }
+};
+
+static thread_local perf_thread perf_self;
+
+#ifdef __linux__
+static const uint32_t perf_types[GC_PERF_EVENTS] =
+{
+  PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+  PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE
+};
+static const uint64_t perf_configs[GC_PERF_EVENTS] =
+{
+  PERF_COUNT_HW_CPU_CYCLES,
+  PERF_COUNT_HW_INSTRUCTIONS,
+  PERF_COUNT_HW_CACHE_MISSES,      /* Last level, on most CPUs */
+  PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+  PERF_COUNT_HW_BRANCH_MISSES
+};
+
+/* User space only, on the calling thread. */
+static int perf_open_event(int event, int group, uint64_t read_format)
+{
+  perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = perf_types[event];
+  attr.config = perf_configs[event];
+  attr.read_format = read_format;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+static void perf_open(perf_thread *self)
+{
+  int nopen = 0;
+
+  /* Counters the CPU lacks are left out, the first that opens leads the group. */
+  for(int i = 0; i < GC_PERF_EVENTS; i++)
+  {
+    int fd = perf_open_event(i, self->leader, PERF_FORMAT_GROUP);
+    if(fd < 0) { continue; }
+    if(self->leader < 0) { self->leader = fd; }
+    self->fd[i] = fd;
+    self->slot[i] = nopen++;
+  }
+}
+
+static void perf_sample(perf_thread *self, int64_t *out)
+{
+  uint64_t buf[1 + GC_PERF_EVENTS];
+
+  for(int i = 0; i < GC_PERF_EVENTS; i++) { out[i] = -1; }
+  if(self->leader < 0 || read(self->leader, buf, sizeof(buf)) < (ssize_t)sizeof(uint64_t))
+  { return; }
+
+  for(int i = 0; i < GC_PERF_EVENTS; i++)
+  {
+    if(self->slot[i] >= 0 && (uint64_t)self->slot[i] < buf[0])
+    { out[i] = (int64_t)buf[1 + self->slot[i]]; }
+  }
+}
+#else
+static void perf_open(perf_thread *self) { (void)self; }
+
+static void perf_sample(perf_thread *self, int64_t *out)
+{
+  (void)self;
+  for(int i = 0; i < GC_PERF_EVENTS; i++) { out[i] = -1; }
+}
+#endif
+
+static void perf_reset(gc_perf_phase *phases)
+{
+  for(int p = 0; p < GC_PERF_PHASES; p++)
+  {
+    phases[p].entered = 0;
+    phases[p].ms = 0;
+    for(int i = 0; i < GC_PERF_EVENTS; i++) { phases[p].count[i] = -1; }
+  }
+}
+
+void gc_perf_enable(const char *path)
+{
+  std::lock_guard<std::mutex> hold(perf_mutex);
+  if(!gc_perf_on)
+  {
+    perf_reset(perf_now);
+    perf_reset(perf_last);
+  }
+  gc_perf_on = 1;
+
+  if(path)
+  {
+    gc_log_init(&perf_log, path, "cycle\tphase\tentered\tms\tcycles\tinstructions\t"
+                "llc_misses\tdtlb_misses\tbranch_misses\n", GC_PERF_LOG_MAX, GC_PERF_LOG_KEEP);
+  }
+}
+
+void gc_perf_begin(int phase)
+{
+  perf_thread *self = &perf_self;
+  (void)phase;
+
+  if(!self->opened)
+  {
+    perf_open(self);
+    self->opened = 1;
+  }
+  perf_sample(self, self->start_count);
+  self->start = perf_clock::now();
+}
+
+void gc_perf_end(int phase)
+{
+  perf_thread *self = &perf_self;
+  perf_clock::time_point end = perf_clock::now();
+  int64_t count[GC_PERF_EVENTS];
+
+  perf_sample(self, count);
+
+  std::lock_guard<std::mutex> hold(perf_mutex);
+  gc_perf_phase *now = &perf_now[phase];
+  now->entered++;
+  now->ms += std::chrono::duration<double, std::milli>(end - self->start).count();
+  for(int i = 0; i < GC_PERF_EVENTS; i++)
+  {
+    if(count[i] < 0 || self->start_count[i] < 0) { continue; }
+    if(now->count[i] < 0) { now->count[i] = 0; }
+    now->count[i] += count[i] - self->start_count[i];
+  }
+}
+
+static void log_cycle()
+{
+  FILE *log_file = gc_log_file(&perf_log);
+  if(!log_file) { return; }
+
+  for(int p = 0; p < GC_PERF_PHASES; p++)
+  {
+    gc_perf_phase *last = &perf_last[p];
+    if(!last->entered) { continue; }
+
+    fprintf(log_file, "%llu\t%s\t%llu\t%.3f", (unsigned long long)perf_ncycles,
+            gc_perf_phase_names[p], (unsigned long long)last->entered, last->ms);
+    for(int i = 0; i < GC_PERF_EVENTS; i++) { fprintf(log_file, "\t%lld", (long long)last->count[i]); }
+    fprintf(log_file, "\n");
+  }
+  fflush(log_file);
+}
+
+void gc_perf_cycle()
+{
+  std::lock_guard<std::mutex> hold(perf_mutex);
+  memcpy(perf_last, perf_now, sizeof(perf_now));
+  perf_reset(perf_now);
+  perf_ncycles++;
+
+  if(perf_log.path) { log_cycle(); }
+}
+
+/* Copies out the last completed cycle. Returns its number, 0 if there was none yet. */
+uint64_t gc_perf_read(gc_perf_phase out[GC_PERF_PHASES])
+{
+  std::lock_guard<std::mutex> hold(perf_mutex);
+  memcpy(out, perf_last, sizeof(perf_last));
+  return perf_ncycles;
+}
+
+#ifdef __linux__
+int gc_perf_counter_open(int event)
+{
+  return perf_open_event(event, -1, 0);
+}
+
+int64_t gc_perf_counter_read(int counter)
+{
+  uint64_t count;
+  if(counter < 0 || read(counter, &count, sizeof(count)) != sizeof(count)) { return -1; }
+  return (int64_t)count;
+}
+
+void gc_perf_counter_close(int counter)
+{
+  if(counter >= 0) { close(counter); }
+}
+#else
+int gc_perf_counter_open(int event) { (void)event; return -1; }
+int64_t gc_perf_counter_read(int counter) { (void)counter; return -1; }
+void gc_perf_counter_close(int counter) { (void)counter; }
+#endif
@@ -0,0 +1,66 @@
+#ifndef GC_PERF_HPP
+#define GC_PERF_HPP
+
+/*
+ *  Hardware counters per collector phase.
+ *
+ *  When enabled, the collector brackets its clear, mark and
+ *  sweep phases with gc_perf_begin and gc_perf_end, and calls
+ *  gc_perf_cycle when a cycle is done. Each thread that runs
+ *  a phase opens its own counter group with perf_event_open
+ *  the first time, so concurrent collectors count their own
+ *  thread. A phase entered more than once in a cycle, say a
+ *  restarted concurrent mark, adds up.
+ *
+ *  The last cycle can be read back with gc_perf_read and is
+ *  appended to a rotating log file. Where the counters can't
+ *  be opened (not Linux, perf_event_paranoid, no PMU in a VM)
+ *  they read as -1 and only the time is kept.
+ */
+
+#include <stdint.h>
+
+#define GC_PERF_CLEAR   0
+#define GC_PERF_MARK    1
+#define GC_PERF_SWEEP   2
+#define GC_PERF_PHASES  3
+
+#define GC_PERF_CYCLES        0
+#define GC_PERF_INSTRUCTIONS  1
+#define GC_PERF_LLC_MISSES    2
+#define GC_PERF_DTLB_MISSES   3
+#define GC_PERF_BRANCH_MISSES 4
+#define GC_PERF_EVENTS        5
+
+#define GC_PERF_LOG_MAX  ((long)1 << 20)   /* Rotate the log past this size */
+#define GC_PERF_LOG_KEEP 4                 /* Rotated files kept, path.1 is the newest */
+
+struct gc_perf_phase
+{
+  uint64_t entered;                 /* Times the phase ran this cycle */
+  double ms;
+  int64_t count[GC_PERF_EVENTS];    /* -1 if the counter isn't available */
+};
+
+extern int gc_perf_on;
+extern const char *gc_perf_phase_names[GC_PERF_PHASES];
+
+void gc_perf_enable(const char *log_path);
+uint64_t gc_perf_read(gc_perf_phase out[GC_PERF_PHASES]);
+
+/* Collector side. */
+void gc_perf_begin(int phase);
+void gc_perf_end(int phase);
+void gc_perf_cycle();
+
+/*
+ *  A single counter on the calling thread, outside the phase
+ *  groups and whether or not gc_perf_enable was called. It
+ *  counts from the open. Open returns -1 and read returns -1
+ *  where the counter isn't available.
+ */
+int gc_perf_counter_open(int event);
+int64_t gc_perf_counter_read(int counter);
+void gc_perf_counter_close(int counter);
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef GC_PHASE_HPP
+#define GC_PHASE_HPP
+
+/*
+ *  Phase and cycle boundaries, for the collectors to report
+ *  to the hardware counters (gc_perf) and the timeline
+ *  (gc_event) alike. Each does nothing unless its side is on.
+ */
+
+#include "gc_perf.hpp"
+#include "gc_event.hpp"
+
+static inline void gc_phase_begin(int phase)
+{
+  if(gc_perf_on) { gc_perf_begin(phase); }
+  if(gc_event_on) { gc_event_begin(gc_perf_phase_names[phase]); }
+}
+
+static inline void gc_phase_end(int phase)
+{
+  if(gc_perf_on) { gc_perf_end(phase); }
+  if(gc_event_on) { gc_event_end(gc_perf_phase_names[phase]); }
+}
+
+static inline void gc_phase_cycle_begin()
+{
+  if(gc_event_on) { gc_event_instant("cycle start", 0); }
+}
+
+/* arg is shown on the timeline, say the objects marked or the cycle number. */
+static inline void gc_phase_cycle_end(uint64_t arg)
+{
+  if(gc_perf_on) { gc_perf_cycle(); }
+  if(gc_event_on) { gc_event_instant("cycle end", arg); }
+}
+
+#endif
@@ -0,0 +1,284 @@
+#include "gc_record.hpp"
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <unordered_map>
+#include <vector>
+
+#define RECORD_MAGIC   "GCTR"
+#define RECORD_VERSION 1
+#define RECORD_BUF     (64 * 1024)
+#define RECORD_EVENT   64     /* Room for the biggest event, 1 + 4 * 10 bytes */
+
+#define OP_ALLOC   1    /* len, type, flags */
+#define OP_ATOMIC  2    /* len, flags */
+#define OP_INC     3    /* ref */
+#define OP_DEC     4    /* ref */
+#define OP_STORE   5    /* ref, offset, ref */
+#define OP_COLLECT 6
+
+typedef std::chrono::steady_clock record_clock;
+
+int gc_record_on;
+
+static FILE *record_file;
+static unsigned char record_buf[RECORD_BUF];
+static size_t record_len;
+static std::unordered_map<void *, uint64_t> *record_ids;
+static uint64_t record_next = 1;      /* Id of the next allocation, 0 is null */
+static record_clock::time_point record_last;
+
+static void record_flush()
+{
+  if(record_len) { fwrite(record_buf, 1, record_len, record_file); }
+  record_len = 0;
+}
+
+static void put_varint(uint64_t v)
+{
+  while(v >= 0x80)
+  {
+    record_buf[record_len++] = (unsigned char)(v | 0x80);
+    v >>= 7;
+  }
+  record_buf[record_len++] = (unsigned char)v;
+}
+
+static void put_op(int op)
+{
+  if(record_len > RECORD_BUF - RECORD_EVENT) { record_flush(); }
+
+  record_clock::time_point now = record_clock::now();
+  record_buf[record_len++] = (unsigned char)op;
+  put_varint(std::chrono::duration_cast<std::chrono::nanoseconds>(now - record_last).count());
+  record_last = now;
+}
+
+static void put_ref(void *obj)
+{
+  std::unordered_map<void *, uint64_t>::iterator found;
+  if(!obj || (found = record_ids->find(obj)) == record_ids->end()) { put_varint(0); }
+  else { put_varint(record_next - found->second); }
+}
+
+/* The trace is flushed at exit, or by gc_record_close. */
+int gc_record_open(const char *path)
+{
+  static int registered;
+
+  if(record_file) { return -1; }
+  record_file = fopen(path, "wb");
+  if(!record_file) { return -1; }
+
+  fwrite(RECORD_MAGIC, 1, 4, record_file);
+  fputc(RECORD_VERSION, record_file);
+  record_ids = new std::unordered_map<void *, uint64_t>();
+  record_next = 1;
+  record_last = record_clock::now();
+  gc_record_on = 1;
+
+  if(!registered) { atexit(gc_record_close); }
+  registered = 1;
+  return 0;
+}
+
+void gc_record_close()
+{
+  if(!record_file) { return; }
+
+  record_flush();
+  fclose(record_file);
+  record_file = 0;
+  gc_record_on = 0;
+  delete record_ids;
+  record_ids = 0;
+}
+
+/* A reused address just takes the new id, the old object is gone. */
+void gc_record_alloc(void *obj, size_t len, size_t type, int flags)
+{
+  put_op(OP_ALLOC);
+  put_varint(len);
+  put_varint(type);
+  put_varint(flags);
+  (*record_ids)[obj] = record_next++;
+}
+
+void gc_record_atomic(void *obj, size_t len, int flags)
+{
+  put_op(OP_ATOMIC);
+  put_varint(len);
+  put_varint(flags);
+  (*record_ids)[obj] = record_next++;
+}
+
+void gc_record_inc(void *obj)
+{
+  put_op(OP_INC);
+  put_ref(obj);
+}
+
+void gc_record_dec(void *obj)
+{
+  put_op(OP_DEC);
+  put_ref(obj);
+}
+
+void gc_record_store(void *obj, size_t offset, void *value)
+{
+  put_op(OP_STORE);
+  put_ref(obj);
+  put_varint(offset);
+  put_ref(value);
+}
+
+void gc_record_collect()
+{
+  put_op(OP_COLLECT);
+}
+
+static int get_varint(const unsigned char **p, const unsigned char *end, uint64_t *v)
+{
+  *v = 0;
+  for(int shift = 0; *p < end && shift < 64; shift += 7)
+  {
+    unsigned char byte = *(*p)++;
+    *v |= (uint64_t)(byte & 0x7F) << shift;
+    if(!(byte & 0x80)) { return 1; }
+  }
+  return 0;
+}
+
+/* Upper bound in microseconds of the bucket holding the q-th fraction of calls. */
+static double replay_quantile(const uint64_t *hist, uint64_t ncalls, uint64_t max_ns, double q)
+{
+  uint64_t want = (uint64_t)(q * ncalls), seen = 0;
+  for(int b = 0; b < 64; b++)
+  {
+    seen += hist[b];
+    if(seen > want)
+    {
+      uint64_t bound = (uint64_t)1 << b;
+      return (bound < max_ns ? bound : max_ns) / 1000.0;
+    }
+  }
+  return 0;
+}
+
+/*
+ *  A trace cut short, say by a killed recorder, replays up
+ *  to its last whole event.
+ */
+int gc_replay(const char *path, const gc_replay_ops *ops)
+{
+  FILE *in = fopen(path, "rb");
+  if(!in) { perror(path); return 1; }
+
+  fseek(in, 0, SEEK_END);
+  long sz = ftell(in);
+  fseek(in, 0, SEEK_SET);
+  unsigned char *data = (unsigned char *)malloc(sz > 0 ? sz : 1);
+  if(sz < 5 || fread(data, 1, sz, in) != (size_t)sz ||
+     memcmp(data, RECORD_MAGIC, 4) || data[4] != RECORD_VERSION)
+  {
+    printf("%s: not a version %d allocation trace\n", path, RECORD_VERSION);
+    fclose(in);
+    free(data);
+    return 1;
+  }
+  fclose(in);
+
+  /* Indexed by id, objs[0] is null. */
+  std::vector<void *> objs(1, (void *)0);
+  uint64_t hist[64] = {0};
+  uint64_t nevents = 0, nallocs = 0, nfailed = 0, nbytes = 0;
+  uint64_t npauses = 0, pause_ns = 0, max_ns = 0, recorded_ns = 0;
+
+  const unsigned char *p = data + 5, *end = data + sz;
+  record_clock::time_point start = record_clock::now();
+  while(p < end)
+  {
+    int op = *p++;
+    uint64_t dt, arg[3] = {0, 0, 0};
+    int nargs = op == OP_ALLOC || op == OP_STORE ? 3 : op == OP_ATOMIC ? 2 :
+                op == OP_INC || op == OP_DEC ? 1 : 0;
+
+    if(op < OP_ALLOC || op > OP_COLLECT)
+    {
+      printf("%s: bad opcode %d after %llu events\n", path, op, (unsigned long long)nevents);
+      break;
+    }
+    if(!get_varint(&p, end, &dt)) { break; }
+    int got = 0;
+    while(got < nargs && get_varint(&p, end, &arg[got])) { got++; }
+    if(got < nargs) { break; }
+
+    /* References count back from the next id. */
+    void *ref = arg[0] && arg[0] < objs.size() ? objs[objs.size() - arg[0]] : 0;
+    void *value = arg[2] && arg[2] < objs.size() ? objs[objs.size() - arg[2]] : 0;
+
+    record_clock::time_point before = record_clock::now();
+    switch(op)
+    {
+    case OP_ALLOC:
+    case OP_ATOMIC:
+    {
+      void *obj;
+      if(op == OP_ALLOC) { obj = ops->create(arg[0], arg[1], (int)arg[2]); }
+      else if(ops->create_atomic) { obj = ops->create_atomic(arg[0], (int)arg[1]); }
+      else { obj = ops->create(arg[0], 0, (int)arg[1]); }
+
+      objs.push_back(obj);
+      nallocs++;
+      nbytes += arg[0];
+      if(!obj) { nfailed++; }
+      break;
+    }
+    case OP_INC:
+      if(ref) { ops->inc(ref); }
+      break;
+    case OP_DEC:
+      if(ref) { ops->dec(ref); }
+      break;
+    case OP_STORE:
+      if(ref) { ops->store(ref, arg[1], value); }
+      break;
+    case OP_COLLECT:
+      if(ops->collect) { ops->collect(); }
+      break;
+    }
+    uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  record_clock::now() - before).count();
+
+    int b = 0;
+    while(b < 63 && ((uint64_t)1 << b) <= ns) { b++; }
+    hist[b]++;
+    if(ns > max_ns) { max_ns = ns; }
+    if(ns >= GC_RECORD_PAUSE_NS)
+    {
+      npauses++;
+      pause_ns += ns;
+    }
+    recorded_ns += dt;
+    nevents++;
+  }
+  double secs = std::chrono::duration<double>(record_clock::now() - start).count();
+  free(data);
+
+  printf("replay: %llu events, %llu allocs (%llu failed), %.1f MB in %.3f s\n",
+         (unsigned long long)nevents, (unsigned long long)nallocs,
+         (unsigned long long)nfailed, nbytes / 1048576.0, secs);
+  printf("  %.0f allocs/s, %.1f MB/s, recorded over %.3f s\n",
+         secs > 0 ? nallocs / secs : 0.0, secs > 0 ? nbytes / 1048576.0 / secs : 0.0,
+         recorded_ns / 1e9);
+  printf("  call latency: p50 <= %.1f us, p99 <= %.1f us, p99.9 <= %.1f us, max %.1f us\n",
+         replay_quantile(hist, nevents, max_ns, 0.5), replay_quantile(hist, nevents, max_ns, 0.99),
+         replay_quantile(hist, nevents, max_ns, 0.999), max_ns / 1000.0);
+  printf("  pauses >= %d us: %llu, %.2f ms total\n", GC_RECORD_PAUSE_NS / 1000,
+         (unsigned long long)npauses, pause_ns / 1e6);
+
+  return 0;
+}
@@ -0,0 +1,59 @@
+#ifndef GC_RECORD_HPP
+#define GC_RECORD_HPP
+
+/*
+ *  Allocation trace recording and replay.
+ *
+ *  While recording, the collector reports every allocation,
+ *  root count change and reference store. Objects are named
+ *  by id in allocation order, so the trace holds no addresses.
+ *  Each event is an opcode byte, the nanoseconds since the
+ *  previous event and its operands, all as LEB128 varints.
+ *  References are written as distance back from the newest
+ *  id, which keeps them to a byte or two for young objects.
+ *
+ *  gc_replay drives any collector from a trace through a
+ *  table of callbacks, as fast as it can, and reports the
+ *  throughput and the latency of each call. A slow call is a
+ *  collection pause the mutator would have felt.
+ *
+ *  References to objects the recorder never saw allocated
+ *  are written as null, and the replayer skips them.
+ */
+
+#include <stddef.h>
+
+#define GC_RECORD_PAUSE_NS 100000   /* Calls at least this slow count as pauses */
+
+extern int gc_record_on;
+
+int  gc_record_open(const char *path);
+void gc_record_close();
+
+void gc_record_alloc(void *obj, size_t len, size_t type, int flags);
+void gc_record_atomic(void *obj, size_t len, int flags);
+void gc_record_inc(void *obj);
+void gc_record_dec(void *obj);
+void gc_record_store(void *obj, size_t offset, void *value);
+void gc_record_collect();
+
+/*
+ *  Flags and type ids are passed on as recorded, so the
+ *  collector replaying a trace needs a compatible type table.
+ *  create_atomic and collect may be 0: atomic objects are
+ *  then created as leaves with type 0, and explicit
+ *  collections are skipped.
+ */
+struct gc_replay_ops
+{
+  void *(*create)(size_t len, size_t type, int flags);
+  void *(*create_atomic)(size_t len, int flags);
+  void (*inc)(void *obj);
+  void (*dec)(void *obj);
+  void (*store)(void *obj, size_t offset, void *value);
+  void (*collect)();
+};
+
+int gc_replay(const char *path, const gc_replay_ops *ops);
+
+#endif
@@ -0,0 +1,75 @@
+#include "gc_root.hpp"
+
+#include <stdlib.h>
+#include <assert.h>
+
+static uint64_t root_home(gc_root_table *table, void *obj)
+{ return ((uint64_t)(uintptr_t)obj * 0x9E3779B97F4A7C15ull >> 32) & table->mask; }
+
+void gc_root_init(gc_root_table *table, size_t nslots)
+{
+  table->mask = nslots - 1;
+  table->roots = (gc_root *)calloc(nslots, sizeof(gc_root));
+  table->nroots = 0;
+  assert(table->roots);
+}
+
+gc_root *gc_root_find(gc_root_table *table, void *obj)
+{
+  for(uint64_t i = root_home(table, obj); table->roots[i].obj; i = (i + 1) & table->mask)
+  {
+    if(table->roots[i].obj == obj) { return &table->roots[i]; }
+  }
+  return 0;
+}
+
+gc_root *gc_root_insert(gc_root_table *table, void *obj)
+{
+  if((table->nroots + 1) * 2 > table->mask + 1)
+  {
+    gc_root *old = table->roots;
+    uint64_t old_sz = table->mask + 1;
+
+    table->mask = old_sz * 2 - 1;
+    table->roots = (gc_root *)calloc(table->mask + 1, sizeof(gc_root));
+    assert(table->roots);
+    for(uint64_t i = 0; i < old_sz; i++)
+    {
+      if(!old[i].obj) { continue; }
+      uint64_t j = root_home(table, old[i].obj);
+      while(table->roots[j].obj) { j = (j + 1) & table->mask; }
+      table->roots[j] = old[i];
+    }
+    free(old);
+  }
+
+  uint64_t i = root_home(table, obj);
+  while(table->roots[i].obj) { i = (i + 1) & table->mask; }
+  table->roots[i].obj = obj;
+  table->roots[i].rrcnt = 0;
+  table->nroots++;
+  return &table->roots[i];
+}
+
+void gc_root_remove(gc_root_table *table, gc_root *entry)
+{
+  gc_root *roots = table->roots;
+  uint64_t i = entry - roots;
+  uint64_t j = i;
+
+  while(1)
+  {
+    j = (j + 1) & table->mask;
+    if(!roots[j].obj) { break; }
+
+    uint64_t k = root_home(table, roots[j].obj);
+    if((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j))
+    {
+      roots[i] = roots[j];
+      i = j;
+    }
+  }
+
+  roots[i].obj = 0;
+  table->nroots--;
+}
@@ -0,0 +1,39 @@
+#ifndef GC_ROOT_HPP
+#define GC_ROOT_HPP
+
+/*
+ *  Side table of root counts, for collectors whose headers
+ *  have no room for one. Open addressing with linear probing,
+ *  keyed on the object's address. It doubles once half full
+ *  and deletes by shifting entries back, so probe chains stay
+ *  intact without tombstones.
+ *
+ *  Tracing walks every slot of the table, skipping empty ones.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct gc_root
+{
+  void *obj;                     /* 0 when the slot is empty */
+  int64_t rrcnt;
+};
+
+struct gc_root_table
+{
+  gc_root *roots;
+  uint64_t mask;                 /* Slots minus one, a power of two */
+  uint64_t nroots;
+};
+
+/* nslots must be a power of two. */
+void gc_root_init(gc_root_table *table, size_t nslots);
+
+gc_root *gc_root_find(gc_root_table *table, void *obj);
+
+/* Returns the new entry, with a zero count. */
+gc_root *gc_root_insert(gc_root_table *table, void *obj);
+void gc_root_remove(gc_root_table *table, gc_root *entry);
+
+#endif
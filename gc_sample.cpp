@@ -0,0 +1,255 @@
+#include "gc_sample.hpp"
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#elif defined(__GLIBC__)
+#include <execinfo.h>
+#endif
+
+#define SAMPLE_DEPTH  32
+#define SAMPLE_SITES  1024
+#define SAMPLE_LIVE   8192
+#define SAMPLE_SKIP   1     /* Drop gc_sample_record's own frame. */
+
+struct sample_site
+{
+  void *pcs[SAMPLE_DEPTH];
+  int used, depth;
+  uint64_t hash;
+  uint64_t alloc_objs, alloc_bytes;
+  uint64_t inuse_objs, inuse_bytes;
+};
+
+struct sample_live
+{
+  void *obj;
+  size_t len;
+  int site;
+};
+
+long long gc_sample_countdown = INT64_MAX;
+
+static size_t sample_rate;
+static uint64_t sample_rng = 0x9E3779B97F4A7C15ull;
+static sample_site sites[SAMPLE_SITES];
+static int nsites;
+static sample_live live[SAMPLE_LIVE];
+static int nlive;
+static uint64_t ndropped;
+static uint64_t nuntracked;   /* Counted as allocated only, the live table was full */
+static char *dump_path;
+
+/*
+ *  Exponentially distributed gap with mean sample_rate,
+ *  which makes the sampled bytes a Poisson process.
+ */
+static long long sample_next_gap()
+{
+  sample_rng ^= sample_rng << 13;
+  sample_rng ^= sample_rng >> 7;
+  sample_rng ^= sample_rng << 17;
+
+  /* 53 random bits in (0, 1]. */
+  double u = ((sample_rng >> 11) + 1) * (1.0 / 9007199254740992.0);
+  return (long long)(-log(u) * (double)sample_rate) + 1;
+}
+
+static int sample_backtrace(void **pcs)
+{
+#if defined(_WIN32)
+  return CaptureStackBackTrace(SAMPLE_SKIP, SAMPLE_DEPTH, pcs, 0);
+#elif defined(__GLIBC__)
+  void *raw[SAMPLE_DEPTH + SAMPLE_SKIP];
+  int depth = backtrace(raw, SAMPLE_DEPTH + SAMPLE_SKIP) - SAMPLE_SKIP;
+  if(depth < 0) { depth = 0; }
+  memcpy(pcs, raw + SAMPLE_SKIP, depth * sizeof(void *));
+  return depth;
+#else
+  (void)pcs;
+  return 0;
+#endif
+}
+
+static int sample_site_find(void **pcs, int depth)
+{
+  uint64_t hash = 0xCBF29CE484222325ull;
+  for(int i = 0; i < depth; i++)
+  { hash = (hash ^ (uint64_t)(uintptr_t)pcs[i]) * 0x100000001B3ull; }
+
+  /* Open addressing. Give up once the table is full. */
+  for(int probe = 0; probe < SAMPLE_SITES; probe++)
+  {
+    int i = (int)((hash + probe) % SAMPLE_SITES);
+    sample_site *site = &sites[i];
+
+    if(!site->used)
+    {
+      if(nsites >= SAMPLE_SITES * 3 / 4) { return -1; }
+      memcpy(site->pcs, pcs, depth * sizeof(void *));
+      site->used = 1;
+      site->depth = depth;
+      site->hash = hash;
+      nsites++;
+      return i;
+    }
+    if(site->hash == hash && site->depth == depth &&
+       !memcmp(site->pcs, pcs, depth * sizeof(void *)))
+    { return i; }
+  }
+
+  return -1;
+}
+
+void gc_sample_init(size_t rate)
+{
+  memset(sites, 0, sizeof(sites));
+  nsites = 0;
+  nlive = 0;
+  ndropped = 0;
+  nuntracked = 0;
+  sample_rate = rate;
+  gc_sample_countdown = rate ? sample_next_gap() : INT64_MAX;
+}
+
+static void dump_at_exit()
+{
+  if(gc_sample_dump(dump_path)) { perror(dump_path); }
+}
+
+/* Like gc_sample_init, and dumps the profile to path at exit if given. */
+void gc_sample_enable(size_t rate, const char *path)
+{
+  gc_sample_init(rate);
+
+  if(path && !dump_path)
+  {
+    dump_path = (char *)malloc(strlen(path) + 1);
+    strcpy(dump_path, path);
+    atexit(dump_at_exit);
+  }
+}
+
+void gc_sample_record(void *obj, size_t len)
+{
+  if(!sample_rate)
+  {
+    gc_sample_countdown = INT64_MAX;
+    return;
+  }
+  gc_sample_countdown = sample_next_gap();
+
+  void *pcs[SAMPLE_DEPTH];
+  int depth = sample_backtrace(pcs);
+  int site = sample_site_find(pcs, depth);
+
+  if(site < 0)
+  {
+    ndropped++;
+    return;
+  }
+
+  sites[site].alloc_objs++;
+  sites[site].alloc_bytes += len;
+
+  /* Still counts as allocated, it just can't be followed to its death. */
+  if(nlive >= SAMPLE_LIVE)
+  {
+    nuntracked++;
+    return;
+  }
+
+  sites[site].inuse_objs++;
+  sites[site].inuse_bytes += len;
+
+  live[nlive].obj = obj;
+  live[nlive].len = len;
+  live[nlive].site = site;
+  nlive++;
+}
+
+/*
+ *  Must be called right after a collection, before the
+ *  allocator can hand a dead sample's memory out again.
+ */
+void gc_sample_reap(int (*is_live)(void *obj))
+{
+  int kept = 0;
+
+  for(int i = 0; i < nlive; i++)
+  {
+    if(is_live(live[i].obj)) { live[kept++] = live[i]; }
+    else
+    {
+      sample_site *site = &sites[live[i].site];
+      site->inuse_objs--;
+      site->inuse_bytes -= live[i].len;
+    }
+  }
+  nlive = kept;
+}
+
+/*
+ *  Legacy pprof heap profile. `pprof -sample_index=alloc_space`
+ *  or `-sample_index=inuse_space` picks between the two views.
+ */
+int gc_sample_dump(const char *path)
+{
+  FILE *out = fopen(path, "w");
+  if(!out) { return -1; }
+
+  uint64_t inuse_objs = 0, inuse_bytes = 0, alloc_objs = 0, alloc_bytes = 0;
+  for(int i = 0; i < SAMPLE_SITES; i++)
+  {
+    inuse_objs += sites[i].inuse_objs;
+    inuse_bytes += sites[i].inuse_bytes;
+    alloc_objs += sites[i].alloc_objs;
+    alloc_bytes += sites[i].alloc_bytes;
+  }
+
+  fprintf(out, "heap profile: %llu: %llu [%llu: %llu] @ heap_v2/%llu\n",
+          (unsigned long long)inuse_objs, (unsigned long long)inuse_bytes,
+          (unsigned long long)alloc_objs, (unsigned long long)alloc_bytes,
+          (unsigned long long)sample_rate);
+
+  for(int i = 0; i < SAMPLE_SITES; i++)
+  {
+    sample_site *site = &sites[i];
+    if(!site->alloc_objs) { continue; }
+
+    fprintf(out, "%llu: %llu [%llu: %llu] @",
+            (unsigned long long)site->inuse_objs,
+            (unsigned long long)site->inuse_bytes,
+            (unsigned long long)site->alloc_objs,
+            (unsigned long long)site->alloc_bytes);
+    for(int j = 0; j < site->depth; j++)
+    { fprintf(out, " %p", site->pcs[j]); }
+    fprintf(out, "\n");
+  }
+
+#if defined(__linux__)
+  /* pprof needs the mappings to symbolize. */
+  FILE *maps = fopen("/proc/self/maps", "r");
+  if(maps)
+  {
+    char buf[4096];
+    size_t n;
+    fprintf(out, "\nMAPPED_LIBRARIES:\n");
+    while((n = fread(buf, 1, sizeof(buf), maps)) > 0) { fwrite(buf, 1, n, out); }
+    fclose(maps);
+  }
+#endif
+
+  if(ndropped)
+  { fprintf(stderr, "gc_sample: dropped %llu samples\n", (unsigned long long)ndropped); }
+  if(nuntracked)
+  { fprintf(stderr, "gc_sample: %llu samples missing from in-use, live table full\n", (unsigned long long)nuntracked); }
+
+  fclose(out);
+  return 0;
+}
@@ -0,0 +1,36 @@
+#ifndef GC_SAMPLE_HPP
+#define GC_SAMPLE_HPP
+
+/*
+ *  Sampled allocation-site profiler.
+ *
+ *  Roughly every `rate` allocated bytes (Poisson distributed,
+ *  so every byte is equally likely to be picked) the allocator
+ *  hands the new object to gc_sample_record, which remembers
+ *  the call stack. After each collection, the collector calls
+ *  gc_sample_reap so samples of dead objects stop counting as
+ *  in-use. gc_sample_dump writes a legacy pprof heap profile
+ *  (heap_v2) holding both allocated and in-use counts.
+ *
+ *  In gc_stwtrace, GC_SAMPLE_RATE=bytes turns sampling on and
+ *  GC_SAMPLE_PROFILE=path writes the profile at exit, sampling
+ *  at GC_SAMPLE_DEFAULT_RATE unless a rate is given too.
+ */
+
+#include <stddef.h>
+
+#define GC_SAMPLE_DEFAULT_RATE (512 * 1024)
+
+extern long long gc_sample_countdown;
+
+void gc_sample_init(size_t rate);
+void gc_sample_enable(size_t rate, const char *path);
+void gc_sample_record(void *obj, size_t len);
+void gc_sample_reap(int (*is_live)(void *obj));
+int  gc_sample_dump(const char *path);
+
+/* Allocation fast path: one subtract and compare. */
+static inline int gc_sample_due(size_t len)
+{ return (gc_sample_countdown -= (long long)len) < 0; }
+
+#endif
@@ -1,9 +1,35 @@
 #include "gc_stwtrace.hpp"
+#include "gc_sample.hpp"
+#include "gc_heap.hpp"
+#include "gc_buffer.hpp"
+#include "gc_census.hpp"
+#include "gc_record.hpp"
+#include "gc_phase.hpp"
+#include "gc_mark.hpp"
 
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stddef.h>
 #include <assert.h>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#endif
 
 #define DEBUG_ASSERT(x) assert(x)
 
@@ -16,114 +42,1528 @@ struct gc_tree
 };
 
 static const size_t heap_sz = 1 << 30; 
-static align_t test_heap[heap_sz / sizeof(align_t)];
+static align_t *test_heap;
 extern gclen_t strong_table[];
 
-gclen_t strong_table[] = 
+gclen_t strong_table[] = 
+{
+  /* No children */
+  0,
+
+  /* gc_tree */
+  4,
+  0, sizeof(void *), 2 * sizeof(void *), 3 * sizeof(void *)
+};
+
+#define MIN_ALLOCS  0x0008
+#define MAX_ALLOCS  0x4000
+static int alloc_threshold;
+static int nallocs;
+static int nfreed;
+static int nmarked;
+
+/* Soft heap limit (gc_set_soft_limit, or GC_SOFT_LIMIT at gc_init). */
+#define SOFT_MIN_BUDGET ((gclen_t)64 << 10)
+static gclen_t heap_used;                   /* Bytes in objects, heap and atomic space */
+static std::atomic<gclen_t> sweep_nbytes;   /* Freed by the sweeper, still in heap_used */
+
+static uint64_t soft_used()
+{
+  heap_used -= sweep_nbytes.exchange(0, std::memory_order_relaxed);
+  return heap_used;
+}
+
+const gc_limit_ops gc_limit_collector = { SOFT_MIN_BUDGET, soft_used };
+
+/* Next-fit: allocation resumes after the last object it placed. */
+static gc_meta *rover;
+
+/*
+ *  Atomic space, for objects that hold no references.
+ *
+ *  A separate mapping, so the marker tells atomic objects
+ *  apart by address: it sets their bit in a side bitmap and
+ *  moves on, never touching the object. The sweep walks the
+ *  headers in address order, coalescing dead neighbours into
+ *  an address-ordered first-fit free list.
+ */
+#define ATOMIC_SZ ((size_t)1 << 28)
+
+struct gc_atomic_meta
+{
+  gcrcnt_t rrcnt;
+  gclen_t len  : 63;
+  gclen_t free : 1;
+};
+
+static char *atomic_base;
+static char *atomic_bump;
+static uint64_t *atomic_bits;             /* One bit per align_t of atomic space */
+static gc_atomic_meta *atomic_free;       /* Next link lives in the first payload word */
+static std::vector<gc_atomic_meta *> *atomic_young;   /* Allocated while marking concurrently */
+
+/*
+ *  Background sweeping (GC_BACKGROUND_SWEEP=1 at gc_init).
+ *
+ *  gc_trace returns right after marking. The sweeper thread
+ *  owns the object list and hands dead chunks to the allocator
+ *  through lock-free per-size stacks. The allocator never
+ *  touches the list: it bumps, pops chunks, and keeps its new
+ *  objects on a private pending list until the next trace.
+ */
+#define FREE_CLASSES 64   /* Exact sizes below 512 bytes, the last holds the rest */
+#define SWEEP_BATCH  256
+static int bg_sweep;
+static char *bump;
+static gc_meta *pending, *pending_tail;
+static gc_meta *local_free[FREE_CLASSES];
+static std::atomic<gc_meta *> handoff[FREE_CLASSES];
+
+/* Sweep cursor, shared by the sweeper and an allocator that runs ahead. */
+static std::atomic_flag sweep_lock = ATOMIC_FLAG_INIT;
+static gc_meta *sweep_prev;
+static int sweep_nfreed;
+static std::atomic<int> sweep_active;
+/* Never destroyed: the detached sweeper may still be waiting at exit. */
+static std::mutex *sweep_mutex;
+static std::condition_variable *sweep_cv;
+static void sweeper_thread();
+
+/*
+ *  Mostly-parallel marking (GC_MOSTLY_PARALLEL=1, Linux only).
+ *
+ *  Boehm-style: clear the soft-dirty bits, mark concurrently
+ *  with the mutator, then stop briefly to rescan only the
+ *  objects on pages written in the meantime. No write barrier.
+ *  Builds on the background sweep allocator, which keeps new
+ *  objects off the object list. Mark bits live in a side bitmap
+ *  so the marker doesn't dirty the pages it is watching.
+ */
+#define MP_IDLE    0
+#define MP_MARKING 1
+#define MP_MARKED  2
+#define PAGE_SZ    4096
+static int mp_mark;
+static uint64_t *mark_bits;       /* One bit per align_t of heap */
+static gc_meta **page_first;      /* Object covering each page's first byte */
+static char *mp_limit;            /* Bump pointer when the cycle started */
+static std::thread *mp_thread;
+static std::atomic<int> mp_state;
+static int mp_init();
+static void mp_trace(int wait);
+
+/*
+ *  The mark stack serves the marker thread, the fork child and
+ *  the pause, never two at once. It is mapped in gc_init so
+ *  marking never calls malloc, which a forked child must not.
+ */
+#define MARK_STACK_SZ ((size_t)1 << 20)
+static gc_mark_stack mark_stack;
+static int mark_count;            /* Objects marked with mark_push, census taken */
+
+/*
+ *  Snapshot marking (GC_FORK_MARK=1, Linux only).
+ *
+ *  The pause is a fork(). The child marks its copy-on-write
+ *  view of the heap and streams back the addresses of what it
+ *  found unreachable. Unreachable objects stay unreachable, so
+ *  the parent flags them dead whenever it gets around to
+ *  reading the pipe, and hands them to the background sweeper
+ *  once the child is done. Objects allocated after the fork
+ *  sit on the pending list, which the child never walks, so
+ *  they survive the cycle. The census is the child's, taken
+ *  as of the fork, and sent ahead of the addresses.
+ */
+#define FORK_BATCH 512    /* Addresses per pipe write, PIPE_BUF bytes */
+static int fork_mark;
+static int fork_pid;              /* Child still marking, 0 if none */
+static int fork_fd;
+static std::chrono::steady_clock::time_point fork_time;
+static double fork_pause_ms;      /* Last fork() pause */
+static double fork_reclaim_ms;    /* Last fork to sweep hand off */
+static void fork_trace(int wait);
+
+/*
+ *  Heap images (gc_save_image, gc_load_image).
+ *
+ *  An image holds a graph copied out of the heap, with every
+ *  pointer written for IMAGE_BASE and listed in a relocation
+ *  table. Loading maps the file privately and, if the kernel
+ *  places it at IMAGE_BASE, touches nothing: pages fault in
+ *  as the mutator reads them. Elsewhere every page holding a
+ *  pointer is relocated up front.
+ *
+ *  Image objects carry a marked header and live outside the
+ *  heap, so the marker passes over them like atomic objects,
+ *  without even setting a bit, and the sweeper never sees
+ *  them. They never die.
+ */
+#define IMAGE_MAGIC   "GCIM"
+#define IMAGE_VERSION 1
+#define IMAGE_PAGE    4096
+#define IMAGE_BASE    ((uint64_t)0x200000000000)
+
+struct image_header
+{
+  char magic[4];
+  uint32_t version;
+  uint64_t base;        /* Address the pointers were written for */
+  uint64_t size;        /* Of the whole file, mapped as one */
+  uint64_t root;        /* Offset of the root's payload */
+  uint64_t objs;        /* Objects, from IMAGE_PAGE on */
+  uint64_t objs_len;
+  uint64_t relocs;      /* Offsets of the pointers in the objects */
+  uint64_t nrelocs;
+  uint64_t types;       /* strong_table when saved */
+  uint64_t ntypes;
+};
+
+static char *image_base, *image_end;    /* The loaded image, if any */
+
+/*
+ *  Finalization (gc_register_finalizer).
+ *
+ *  At the end of marking, registered objects left unmarked are
+ *  queued and marked after all, with everything they reach.
+ *  Their finalizers run later on the finalizer thread or in
+ *  gc_run_finalizers, never in the pause. Queued and running
+ *  objects are kept like roots until their finalizer returns.
+ */
+struct final_entry
+{
+  gc_meta *obj;
+  gc_finalizer_fn fn;
+  void *data;
+};
+
+static std::vector<final_entry> *final_table;   /* Registered, reachable at the last trace */
+static std::deque<final_entry> *final_queue;    /* Unreachable, finalizer not run yet */
+static std::vector<gc_meta *> *final_running;
+/* Never destroyed, like the sweeper's. */
+static std::mutex *final_mutex;
+static std::condition_variable *final_cv;
+static void finalizer_thread();
+
+static int marked(gc_meta *meta)
+{
+  if(fork_mark) { return !meta->dead; }
+  if(!mp_mark) { return meta->mark; }
+  gclen_t bit = (align_t *)meta - test_heap;
+  return (mark_bits[bit / 64] >> (bit % 64)) & 1;
+}
+
+static void set_marked(gc_meta *meta)
+{
+  gclen_t bit = (align_t *)meta - test_heap;
+  mark_bits[bit / 64] |= (uint64_t)1 << (bit % 64);
+}
+
+/* Sets whichever mark marked() reads in this cycle. */
+static void set_live(gc_meta *meta)
+{
+  if(fork_mark) { meta->dead = 0; }
+  else if(mp_mark) { set_marked(meta); }
+  else { meta->mark = 1; }
+}
+
+static int atomic_obj(void *alloc)
+{ return (char *)alloc > atomic_base && (char *)alloc < atomic_base + ATOMIC_SZ; }
+
+static int atomic_marked(gc_atomic_meta *meta)
+{
+  gclen_t bit = (align_t *)meta - (align_t *)atomic_base;
+  return (atomic_bits[bit / 64] >> (bit % 64)) & 1;
+}
+
+/* Takes the object, not its header, as the marker finds it. */
+static void atomic_set_marked(void *alloc)
+{
+  gclen_t bit = (align_t *)((gc_atomic_meta *)alloc - 1) - (align_t *)atomic_base;
+  atomic_bits[bit / 64] |= (uint64_t)1 << (bit % 64);
+}
+
+static int image_obj(void *alloc)
+{ return (char *)alloc > image_base && (char *)alloc < image_end; }
+
+static gc_atomic_meta **atomic_next(gc_atomic_meta *meta)
+{ return (gc_atomic_meta **)(meta + 1); }
+
+/* Counts a newly marked object in the census, if one is being taken. */
+static void census(gc_meta *meta)
+{
+  if(!gc_census_on) { return; }
+
+  size_t key = meta->refarray ? GC_CENSUS_REFARRAY :
+               meta->buffer ? GC_CENSUS_BUFFER : gc_census_type(meta->srtptr);
+  gc_census_add(key, meta->len);
+}
+
+void gc_init() 
+{
+  test_heap = (align_t *)gc_heap_map(heap_sz, gc_heap_env_flags());
+  assert(test_heap);
+
+  /* Timeline for chrome://tracing, written at exit, e.g. GC_EVENTS=gc.json */
+  const char *events = getenv("GC_EVENTS");
+  if(events)
+  {
+    gc_event_enable(events);
+    gc_event_name_thread("mutator");
+  }
+
+  gc_meta *begin = (gc_meta *)test_heap;
+  begin->rrcnt = 1;
+  begin->srtptr = 0;
+  begin->refarray = 0;
+  begin->mark = 1;
+  begin->buffer = 0;
+  begin->dead = 0;
+  begin->len = sizeof(gc_meta);
+  begin->next = 0;
+
+  alloc_threshold = MIN_ALLOCS;
+  nallocs = 0;
+  rover = begin;
+
+  atomic_base = (char *)gc_heap_map(ATOMIC_SZ, gc_heap_env_flags());
+  atomic_bits = (uint64_t *)gc_heap_map(ATOMIC_SZ / sizeof(align_t) / 8, 0);
+  assert(atomic_base && atomic_bits);
+  atomic_bump = atomic_base;
+  atomic_free = 0;
+  atomic_young = new std::vector<gc_atomic_meta *>();
+
+  const char *background = getenv("GC_BACKGROUND_SWEEP");
+  const char *parallel = getenv("GC_MOSTLY_PARALLEL");
+  bg_sweep = background && atoi(background);
+  mp_mark = parallel && atoi(parallel) && mp_init();
+#ifdef __linux__
+  const char *forked = getenv("GC_FORK_MARK");
+  fork_mark = !mp_mark && forked && atoi(forked);
+#endif
+  bg_sweep |= mp_mark | fork_mark;
+  gc_mark_init(&mark_stack, gc_heap_map(MARK_STACK_SZ, 0), MARK_STACK_SZ);
+  /* The child's side bitmap, mapped ahead of the fork. Only the child writes to it. */
+  if(fork_mark) { mark_bits = (uint64_t *)gc_heap_map(heap_sz / sizeof(align_t) / 8, 0); }
+  fork_mark = fork_mark && mark_bits;
+  if(bg_sweep)
+  {
+    bump = (char *)(begin + 1);
+    sweep_mutex = new std::mutex();
+    sweep_cv = new std::condition_variable();
+    std::thread(sweeper_thread).detach();
+  }
+
+  /* Opt-in allocation-site sampling, e.g. GC_SAMPLE_RATE=524288, GC_SAMPLE_PROFILE=path writes it out at exit. */
+  const char *sample_rate = getenv("GC_SAMPLE_RATE");
+  const char *sample_profile = getenv("GC_SAMPLE_PROFILE");
+  if(sample_rate || sample_profile)
+  { gc_sample_enable(sample_rate ? strtoull(sample_rate, 0, 0) : GC_SAMPLE_DEFAULT_RATE, sample_profile); }
+
+  /* Live objects and bytes per type after each trace, GC_CENSUS_LOG=path also logs them. */
+  const char *census_env = getenv("GC_CENSUS");
+  const char *census_log = getenv("GC_CENSUS_LOG");
+  if((census_env && atoi(census_env)) || census_log) { gc_census_enable(census_log); }
+
+  /* Hardware counters per phase, GC_PERF_LOG=path also logs each cycle. */
+  const char *perf_env = getenv("GC_PERF");
+  const char *perf_log = getenv("GC_PERF_LOG");
+  if((perf_env && atoi(perf_env)) || perf_log) { gc_perf_enable(perf_log); }
+
+  final_table = new std::vector<final_entry>();
+  final_queue = new std::deque<final_entry>();
+  final_running = new std::vector<gc_meta *>();
+  final_mutex = new std::mutex();
+  final_cv = new std::condition_variable();
+  const char *finalizer = getenv("GC_FINALIZER_THREAD");
+  if(finalizer && atoi(finalizer)) { std::thread(finalizer_thread).detach(); }
+
+  const char *limit = getenv("GC_SOFT_LIMIT");
+  if(limit) { gc_set_soft_limit(strtoull(limit, 0, 0)); }
+
+  /* Allocation trace for ./gc_stwtrace replay, e.g. GC_RECORD=app.gctrace */
+  const char *record = getenv("GC_RECORD");
+  if(record && gc_record_open(record)) { perror(record); }
+}
+
+/*
+ *  Free memory is always zero: the sweep clears what it
+ *  reclaims, so allocation only writes the header.
+ */
+static gc_meta *gc_fit(gc_meta *prev, gclen_t true_len, gclen_t srtptr, int flags)
+{
+  gc_meta *curr = (gc_meta *)prev->next;
+  char *region = (char *)prev + prev->len;
+
+  /* Find space in between two nodes. */
+  while(curr)
+  {
+    if(region + true_len < (char *)curr)
+    {
+      gc_meta *retmeta = (gc_meta *)region;
+      retmeta->rrcnt = flags & ROOT_FLAG ? 1 : 0;
+      retmeta->srtptr = srtptr;
+      retmeta->refarray = flags & REFARRAY_FLAG ? 1 : 0;
+      retmeta->mark = 0;
+      retmeta->buffer = 0;
+      retmeta->dead = 0;
+      retmeta->len = true_len;
+      retmeta->next = curr;
+      prev->next = retmeta;
+
+      return retmeta;
+    }
+
+    prev = curr;
+    region = (char *)prev + prev->len;
+    curr = curr->next;
+  }
+
+  /* If no space to sandwich between, try to allocate at end. */
+  if(!curr && region + true_len < (char *)test_heap + heap_sz)
+  {
+    gc_meta *retmeta = (gc_meta *)region;
+    retmeta->rrcnt = flags & ROOT_FLAG ? 1 : 0;
+    retmeta->srtptr = srtptr;
+    retmeta->refarray = flags & REFARRAY_FLAG ? 1 : 0;
+    retmeta->mark = 0;
+    retmeta->buffer = 0;
+    retmeta->dead = 0;
+    retmeta->len = true_len;
+    retmeta->next = 0;
+    prev->next = retmeta;
+
+    return retmeta;
+  }
+
+  return 0;
+}
+
+static int free_class(gclen_t true_len)
+{
+  gclen_t c = true_len / sizeof(align_t);
+  return c < FREE_CLASSES ? (int)c : FREE_CLASSES - 1;
+}
+
+/*
+ *  Sweeps up to `batch` objects. The sweeper thread publishes
+ *  what it frees, the allocator keeps what it frees itself.
+ *  Freed payloads are zeroed on the way, the header stays
+ *  since it holds the free list link.
+ */
+static void sweep_step(int batch, int to_local)
+{
+  gc_meta *heads[FREE_CLASSES] = {0}, *tails[FREE_CLASSES] = {0};
+
+  while(sweep_lock.test_and_set(std::memory_order_acquire)) { std::this_thread::yield(); }
+
+  gc_meta *prev = sweep_prev;
+  if(!prev)
+  {
+    sweep_lock.clear(std::memory_order_release);
+    return;
+  }
+
+  gc_meta *curr = prev->next;
+  int local_nfreed = 0;
+  gclen_t local_nbytes = 0;
+
+  for(; curr && batch--; curr = prev->next)
+  {
+    if(marked(curr))
+    {
+      curr->mark = 0;
+      prev = curr;
+      continue;
+    }
+
+    prev->next = curr->next;
+    local_nfreed++;
+    local_nbytes += curr->len;
+    if(curr->buffer) { gc_buffer_release((gc_buffer *)(curr + 1)); }
+
+    int c = free_class(curr->len);
+    if(to_local) { gc_heap_zero(curr + 1, curr->len - sizeof(gc_meta)); }
+    gc_meta **head = to_local ? &local_free[c] : &heads[c];
+    if(!to_local && !*head) { tails[c] = curr; }
+    curr->next = *head;
+    *head = curr;
+  }
+
+  sweep_prev = curr ? prev : 0;
+  sweep_nfreed += local_nfreed;
+  sweep_nbytes.fetch_add(local_nbytes, std::memory_order_relaxed);
+  if(!curr) { sweep_active.store(0, std::memory_order_release); }
+  sweep_lock.clear(std::memory_order_release);
+
+  for(int c = 0; !to_local && c < FREE_CLASSES; c++)
+  {
+    if(!heads[c]) { continue; }
+
+    /* Outside the lock, so an allocator running ahead isn't held up. */
+    for(gc_meta *curr = heads[c]; curr; curr = curr->next)
+    { gc_heap_zero(curr + 1, curr->len - sizeof(gc_meta)); }
+
+    gc_meta *top = handoff[c].load(std::memory_order_relaxed);
+    do { tails[c]->next = top; }
+    while(!handoff[c].compare_exchange_weak(top, heads[c],
+                                            std::memory_order_release,
+                                            std::memory_order_relaxed));
+  }
+}
+
+static void sweep_finish()
+{
+  while(sweep_active.load(std::memory_order_acquire)) { sweep_step(SWEEP_BATCH, 1); }
+}
+
+static void sweeper_thread()
+{
+  if(gc_event_on) { gc_event_name_thread("sweeper"); }
+  while(1)
+  {
+    {
+      std::unique_lock<std::mutex> hold(*sweep_mutex);
+      sweep_cv->wait(hold, [] { return sweep_active.load() != 0; });
+    }
+    if(gc_event_on) { gc_event_begin("background sweep"); }
+    while(sweep_active.load(std::memory_order_acquire)) { sweep_step(SWEEP_BATCH, 0); }
+    if(gc_event_on) { gc_event_end("background sweep"); }
+  }
+}
+
+static gc_meta *bg_pop(gclen_t true_len)
+{
+  int c = free_class(true_len);
+  if(!local_free[c])
+  { local_free[c] = handoff[c].exchange(0, std::memory_order_acquire); }
+
+  /* Exact fit below FREE_CLASSES, first fit above it. */
+  gc_meta **link = &local_free[c];
+  while(*link && (*link)->len < true_len) { link = &(*link)->next; }
+
+  /* Nothing kept locally fits, append what the sweeper published since. */
+  if(!*link && (*link = handoff[c].exchange(0, std::memory_order_acquire)))
+  { while(*link && (*link)->len < true_len) { link = &(*link)->next; } }
+
+  gc_meta *retmeta = *link;
+  if(retmeta) { *link = retmeta->next; }
+  return retmeta;
+}
+
+static gc_meta *bg_alloc(gclen_t true_len)
+{
+  gc_meta *retmeta = bg_pop(true_len);
+
+  if(!retmeta && bump + true_len <= (char *)test_heap + heap_sz)
+  {
+    retmeta = (gc_meta *)bump;
+    retmeta->len = true_len;
+    bump += true_len;
+
+    /* Crossing map, so the final mark pause can walk a page. */
+    if(mp_mark)
+    {
+      for(gclen_t p = ((char *)retmeta - (char *)test_heap + PAGE_SZ - 1) / PAGE_SZ;
+          p * PAGE_SZ < (gclen_t)(bump - (char *)test_heap); p++)
+      { page_first[p] = retmeta; }
+    }
+  }
+
+  /* Ran ahead of the sweeper, so sweep on demand. */
+  if(!retmeta && sweep_active.load(std::memory_order_acquire))
+  {
+    if(gc_event_on) { gc_event_begin("alloc stall"); }
+    sweep_finish();
+    retmeta = bg_pop(true_len);
+    if(gc_event_on) { gc_event_end("alloc stall"); }
+  }
+
+  return retmeta;
+}
+
+static gc_meta *bg_create(gclen_t true_len, gclen_t srtptr, int flags)
+{
+  gc_meta *retmeta = bg_alloc(true_len);
+  if(!retmeta) { return 0; }
+
+  retmeta->rrcnt = flags & ROOT_FLAG ? 1 : 0;
+  retmeta->srtptr = srtptr;
+  retmeta->refarray = flags & REFARRAY_FLAG ? 1 : 0;
+  retmeta->mark = 0;
+  retmeta->buffer = 0;
+  retmeta->dead = 0;
+  retmeta->next = pending;
+  if(!pending) { pending_tail = retmeta; }
+  pending = retmeta;
+
+  /* A concurrent marker may find this object as soon as it is stored. */
+  if(mp_mark) { std::atomic_thread_fence(std::memory_order_release); }
+  return retmeta;
+}
+
+static void soft_pace()
+{
+  gc_limit_pace();
+  if(gc_event_on) { gc_event_counter("heap_used", heap_used); }
+}
+
+static void gc_pace()
+{
+  if(nallocs >= alloc_threshold || gc_limit_due())
+  {
+    int local_nallocs = nallocs;
+    int local_threshold = alloc_threshold;
+    if(mp_mark) { mp_trace(0); }
+    else if(fork_mark) { fork_trace(0); }
+    else { gc_trace(); }
+
+    /* Back off when a trace frees little, tighten when it pays. */
+    if(nfreed < local_nallocs / 4 && local_threshold * 2 <= MAX_ALLOCS)
+    { local_threshold *= 2; }
+    else if(nfreed >= local_nallocs / 2 && local_threshold / 2 >= MIN_ALLOCS)
+    { local_threshold /= 2; }
+
+    /* Don't retrace a big live set more often than it can amortize. */
+    while(local_threshold < nmarked / 2 && local_threshold * 2 <= MAX_ALLOCS)
+    { local_threshold *= 2; }
+    alloc_threshold = local_threshold;
+    soft_pace();
+  }
+}
+
+/*
+ *  A cycle in flight keeps everything allocated during it,
+ *  so finish that one and run a fresh one, sweeping it all.
+ */
+static void gc_full_collect()
+{
+  if(mp_state.load(std::memory_order_acquire) != MP_IDLE || fork_pid) { gc_trace(); }
+  gc_trace();
+  if(bg_sweep) { sweep_finish(); }
+  soft_pace();
+}
+
+static int gc_recover(int round, gclen_t need)
+{
+  if(!gc_limit_retry(round, need)) { return 0; }
+  if(gc_event_on) { gc_event_begin("alloc stall"); }
+  gc_full_collect();
+  if(gc_event_on) { gc_event_end("alloc stall"); }
+  return 1;
+}
+
+static gc_meta *gc_place(gclen_t true_len, gclen_t srtptr, int flags)
+{
+  gc_meta *begin = (gc_meta *)test_heap;
+  if(bg_sweep) { return bg_create(true_len, srtptr, flags); }
+
+  gc_meta *retmeta = gc_fit(rover, true_len, srtptr, flags);
+  if(!retmeta && rover != begin)
+  { retmeta = gc_fit(begin, true_len, srtptr, flags); }
+  if(retmeta) { rover = retmeta; }
+  return retmeta;
+}
+
+void *gc_create_ref(gclen_t len, gclen_t srtptr, int flags)
+{
+  gclen_t true_len = (len + sizeof(gc_meta) + sizeof(align_t) - 1) &
+                     ~(sizeof(align_t) - 1);
+
+  gc_pace();
+
+  gc_meta *retmeta = gc_place(true_len, srtptr, flags);
+  for(int round = 0; !retmeta && gc_recover(round, true_len); round++)
+  { retmeta = gc_place(true_len, srtptr, flags); }
+  if(!retmeta) { return 0; }
+
+  nallocs++;
+  heap_used += retmeta->len;
+  gc_limit_alloc(retmeta->len);
+  if(gc_sample_due(true_len)) { gc_sample_record(retmeta + 1, true_len); }
+  if(gc_record_on) { gc_record_alloc(retmeta + 1, len, srtptr, flags); }
+  return retmeta + 1;
+}
+
+static gc_atomic_meta *atomic_alloc(gclen_t true_len)
+{
+  for(gc_atomic_meta **link = &atomic_free; *link; link = atomic_next(*link))
+  {
+    gc_atomic_meta *chunk = *link;
+    if(chunk->len < true_len) { continue; }
+
+    /* Split when the rest can hold a free chunk. */
+    if(chunk->len - true_len >= sizeof(gc_atomic_meta) + sizeof(void *))
+    {
+      gc_atomic_meta *rest = (gc_atomic_meta *)((char *)chunk + true_len);
+      rest->rrcnt = 0;
+      rest->len = chunk->len - true_len;
+      rest->free = 1;
+      *atomic_next(rest) = *atomic_next(chunk);
+      *link = rest;
+      chunk->len = true_len;
+    }
+    else { *link = *atomic_next(chunk); }
+
+    return chunk;
+  }
+
+  if(atomic_bump + true_len > atomic_base + ATOMIC_SZ) { return 0; }
+
+  gc_atomic_meta *chunk = (gc_atomic_meta *)atomic_bump;
+  chunk->len = true_len;
+  atomic_bump += true_len;
+  return chunk;
+}
+
+/*
+ *  Like GC_malloc_atomic: the object must never hold a
+ *  reference to a collected object, because nothing in it
+ *  is traced. Contents are undefined unless ZERO_FLAG is set.
+ */
+void *gc_create_atomic(gclen_t len, int flags)
+{
+  gclen_t true_len = (len + sizeof(gc_atomic_meta) + sizeof(align_t) - 1) &
+                     ~(sizeof(align_t) - 1);
+  if(true_len < sizeof(gc_atomic_meta) + sizeof(void *))
+  { true_len = sizeof(gc_atomic_meta) + sizeof(void *); }
+
+  gc_pace();
+
+  gc_atomic_meta *retmeta = atomic_alloc(true_len);
+  for(int round = 0; !retmeta && gc_recover(round, true_len); round++)
+  { retmeta = atomic_alloc(true_len); }
+  if(!retmeta) { return 0; }
+
+  retmeta->rrcnt = flags & ROOT_FLAG ? 1 : 0;
+  retmeta->free = 0;
+  if(flags & ZERO_FLAG) { memset(retmeta + 1, 0, len); }
+
+  /* Nothing marks it in this cycle, so it is live by decree. */
+  if(mp_state.load(std::memory_order_relaxed) != MP_IDLE)
+  { atomic_young->push_back(retmeta); }
+
+  nallocs++;
+  heap_used += retmeta->len;
+  gc_limit_alloc(retmeta->len);
+  if(gc_sample_due(true_len)) { gc_sample_record(retmeta + 1, true_len); }
+  if(gc_record_on) { gc_record_atomic(retmeta + 1, len, flags); }
+  return retmeta + 1;
+}
+
+/*
+ *  Runs in the pause right after marking. Only touches the
+ *  headers, never the payloads.
+ */
+static void atomic_sweep()
+{
+  gc_atomic_meta **link = &atomic_free;
+  gc_atomic_meta **run_link = 0;
+  gc_atomic_meta *run = 0;
+  int local_nfreed = 0;
+  gclen_t local_nbytes = 0;
+
+  for(char *curr = atomic_base; curr < atomic_bump; )
+  {
+    gc_atomic_meta *meta = (gc_atomic_meta *)curr;
+    curr += meta->len;
+
+    if(!meta->free && (meta->rrcnt > 0 || atomic_marked(meta)))
+    {
+      if(gc_census_on) { gc_census_add(GC_CENSUS_ATOMIC, meta->len); }
+      run = 0;
+      continue;
+    }
+
+    if(!meta->free)
+    {
+      local_nfreed++;
+      local_nbytes += meta->len;
+    }
+    if(run)
+    {
+      run->len += meta->len;
+      continue;
+    }
+
+    meta->rrcnt = 0;
+    meta->free = 1;
+    run = meta;
+    run_link = link;
+    *link = meta;
+    link = atomic_next(meta);
+  }
+  *link = 0;
+
+  /* A free run at the end goes back to the bump pointer. */
+  if(run && (char *)run + run->len == atomic_bump)
+  {
+    atomic_bump = (char *)run;
+    *run_link = 0;
+  }
+
+  gclen_t nbits = (align_t *)atomic_bump - (align_t *)atomic_base;
+  memset(atomic_bits, 0, (nbits + 63) / 64 * sizeof(uint64_t));
+  nfreed += local_nfreed;
+  heap_used -= local_nbytes;
+}
+
+/*
+ *  A buffer object is a leaf (strong table entry 0) whose
+ *  payload lives in the gc_buffer pool, so the marker never
+ *  looks at the bytes. Sweeping it recycles the pages.
+ */
+gc_buffer *gc_create_buffer(gclen_t cap, int flags)
+{
+  gc_buffer pages;
+  if(gc_buffer_alloc(&pages, cap)) { return 0; }
+
+  gc_buffer *buf = (gc_buffer *)gc_create_ref(sizeof(gc_buffer), 0, flags & ~REFARRAY_FLAG);
+  if(!buf)
+  {
+    gc_buffer_release(&pages);
+    return 0;
+  }
+
+  *buf = pages;
+  ((gc_meta *)buf)[-1].buffer = 1;
+  return buf;
+}
+
+void gc_dec_rrcnt(void *alloc)
+{
+  gc_meta *retmeta = ((gc_meta *)alloc) - 1;
+  if(atomic_obj(alloc)) { ((gc_atomic_meta *)alloc)[-1].rrcnt--; }
+  else if(alloc) { retmeta->rrcnt--; } 
+  if(gc_record_on) { gc_record_dec(alloc); }
+}
+
+void gc_inc_rrcnt(void *alloc)
+{
+  gc_meta *retmeta = ((gc_meta *)alloc) - 1;
+  if(atomic_obj(alloc)) { ((gc_atomic_meta *)alloc)[-1].rrcnt++; }
+  else if(alloc) { retmeta->rrcnt++; }
+  if(gc_record_on) { gc_record_inc(alloc); }
+}
+
+/* Image objects aren't traced, what they hold from the heap is counted as a root. */
+static void image_count(void *alloc, gcrcnt_t delta)
+{
+  if(!alloc || image_obj(alloc)) { return; }
+  if(atomic_obj(alloc)) { ((gc_atomic_meta *)alloc)[-1].rrcnt += delta; }
+  else { ((gc_meta *)alloc)[-1].rrcnt += delta; }
+}
+
+/*
+ *  A plain store, the tracer needs no barrier. Stores only
+ *  show up in a recorded trace when they go through here.
+ *  Stores into image objects must.
+ */
+void gc_store_ref(void *alloc, gclen_t offset, void *value)
+{
+  void **field = (void **)((char *)alloc + offset);
+  if(image_obj(alloc))
+  {
+    image_count(value, 1);
+    image_count(*field, -1);
+  }
+  *field = value;
+  if(gc_record_on) { gc_record_store(alloc, offset, value); }
+}
+
+/* Marks stay set on survivors until the next gc_trace. */
+static int sample_is_live(void *obj)
+{
+  if(atomic_obj(obj))
+  {
+    gc_atomic_meta *meta = (gc_atomic_meta *)obj - 1;
+    return !meta->free && (meta->rrcnt > 0 || atomic_marked(meta));
+  }
+  return marked((gc_meta *)obj - 1);
+}
+
+static void sweep_start(gc_meta *prev_start)
+{
+  {
+    std::lock_guard<std::mutex> hold(*sweep_mutex);
+    while(sweep_lock.test_and_set(std::memory_order_acquire)) { std::this_thread::yield(); }
+    sweep_prev = prev_start;
+    sweep_active.store(1, std::memory_order_release);
+    sweep_lock.clear(std::memory_order_release);
+  }
+  sweep_cv->notify_one();
+  if(gc_event_on) { gc_event_instant("sweep handoff", 0); }
+}
+
+/* Bring the pending objects under the collector's control. */
+static gc_meta *splice_pending(gc_meta *prev_start)
+{
+  if(pending)
+  {
+    pending_tail->next = prev_start->next;
+    prev_start->next = pending;
+    pending = 0;
+  }
+  return prev_start->next;
+}
+
+/* Marks whichever mark marked() reads, counts the object and queues it for mp_scan. */
+static void mark_push(gc_meta *meta)
+{
+  set_live(meta);
+  census(meta);
+  mark_count++;
+  gc_mark_push(&mark_stack, meta);
+}
+
+/* Also marks for the other modes, when finalization needs it. */
+static void mp_scan(gc_mark_stack *stack, void *obj)
+{
+  gc_meta *current = (gc_meta *)obj;
+  (void)stack;
+
+  if(current->refarray)
+  {
+    void **children = (void **)(current + 1);
+    for(gclen_t i = 0; i < current->srtptr; i++)
+    {
+      gc_meta *check_mark = (gc_meta *)children[i];
+      if(atomic_obj(check_mark)) { atomic_set_marked(check_mark); continue; }
+      if(image_obj(check_mark)) { continue; }
+      if(check_mark-- && !marked(check_mark)) { mark_push(check_mark); }
+    }
+  }
+  else
+  {
+    gclen_t nchildren = strong_table[current->srtptr];
+    char *base = (char *)(current + 1);
+    for(gclen_t i = current->srtptr + 1; nchildren--; i++)
+    {
+      gc_meta *check_mark = *(gc_meta *volatile *)(base + strong_table[i]);
+      if(atomic_obj(check_mark)) { atomic_set_marked(check_mark); continue; }
+      if(image_obj(check_mark)) { continue; }
+      if(check_mark-- && !marked(check_mark)) { mark_push(check_mark); }
+    }
+  }
+  std::atomic_thread_fence(std::memory_order_acquire);
+}
+
+static void *list_next_marked(void *obj)
+{
+  gc_meta *curr = obj ? ((gc_meta *)obj)->next : ((gc_meta *)test_heap)->next;
+  while(curr && !marked(curr)) { curr = curr->next; }
+  return curr;
+}
+
+/* In a pause, objects allocated since the cycle started are on the pending list. */
+static gc_meta *pause_next(gc_meta *curr)
+{
+  if(curr->next) { return curr->next; }
+  return pending && curr != pending_tail ? pending : 0;
+}
+
+static void *pause_next_marked(void *obj)
+{
+  gc_meta *curr = pause_next(obj ? (gc_meta *)obj : (gc_meta *)test_heap);
+  while(curr && !marked(curr)) { curr = pause_next(curr); }
+  return curr;
+}
+
+/* The marker thread leaves the pending list to the mutator, the pause rescans it too. */
+static const gc_mark_heap list_heap = { mp_scan, list_next_marked, 0 };
+static const gc_mark_heap pause_heap = { mp_scan, pause_next_marked, 0 };
+
+static void final_keep(gc_meta *obj)
+{
+  if(marked(obj)) { return; }
+  mark_push(obj);
+  gc_mark_finish(&mark_stack, &pause_heap);
+}
+
+/*
+ *  Runs in the pause, once marking is done. Keeps the queue
+ *  alive first, so what it reaches isn't finalized, then
+ *  queues every unmarked registered object before marking any
+ *  of them. All of those are finalized this cycle, in no
+ *  particular order. Returns the number of objects it marked.
+ */
+static int final_scan()
+{
+  int first_count = mark_count;
+  size_t kept = 0;
+
+  std::lock_guard<std::mutex> hold(*final_mutex);
+  for(size_t i = 0; i < final_queue->size(); i++)
+  { final_keep((*final_queue)[i].obj); }
+  for(size_t i = 0; i < final_running->size(); i++)
+  { final_keep((*final_running)[i]); }
+
+  size_t first = final_queue->size();
+  for(size_t i = 0; i < final_table->size(); i++)
+  {
+    final_entry entry = (*final_table)[i];
+    if(marked(entry.obj)) { (*final_table)[kept++] = entry; }
+    else { final_queue->push_back(entry); }
+  }
+  final_table->resize(kept);
+
+  for(size_t i = first; i < final_queue->size(); i++)
+  { final_keep((*final_queue)[i].obj); }
+  if(final_queue->size() > first) { final_cv->notify_one(); }
+  return mark_count - first_count;
+}
+
+/* Runs the oldest queued finalizer. Returns 0 if there was none. */
+static int final_run_one()
+{
+  final_entry entry;
+  {
+    std::lock_guard<std::mutex> hold(*final_mutex);
+    if(final_queue->empty()) { return 0; }
+    entry = final_queue->front();
+    final_queue->pop_front();
+    final_running->push_back(entry.obj);
+  }
+
+  /* Unlocked, the finalizer may allocate and so trace. */
+  entry.fn(entry.obj + 1, entry.data);
+
+  std::lock_guard<std::mutex> hold(*final_mutex);
+  for(size_t i = 0; i < final_running->size(); i++)
+  {
+    if((*final_running)[i] != entry.obj) { continue; }
+    (*final_running)[i] = final_running->back();
+    final_running->pop_back();
+    break;
+  }
+  return 1;
+}
+
+static void finalizer_thread()
+{
+  if(gc_event_on) { gc_event_name_thread("finalizer"); }
+  while(1)
+  {
+    {
+      std::unique_lock<std::mutex> hold(*final_mutex);
+      final_cv->wait(hold, [] { return !final_queue->empty(); });
+    }
+    while(final_run_one()) {}
+  }
+}
+
+int gc_register_finalizer(void *alloc, gc_finalizer_fn fn, void *data)
+{
+  if(!alloc || !fn || atomic_obj(alloc) || image_obj(alloc)) { return -1; }
+
+  final_entry entry = { (gc_meta *)alloc - 1, fn, data };
+  final_table->push_back(entry);
+  return 0;
+}
+
+int gc_run_finalizers(int max)
+{
+  int n = 0;
+  while((!max || n < max) && final_run_one()) { n++; }
+  return n;
+}
+
+static void mp_marker()
+{
+  gc_meta *begin = (gc_meta *)test_heap;
+  gclen_t nbits = (align_t *)mp_limit - test_heap;
+
+  if(gc_event_on) { gc_event_name_thread("marker"); }
+  gc_phase_begin(GC_PERF_CLEAR);
+  memset(mark_bits, 0, (nbits + 63) / 64 * sizeof(uint64_t));
+  set_marked(begin);
+  gc_phase_end(GC_PERF_CLEAR);
+  gc_phase_begin(GC_PERF_MARK);
+
+  mark_count = 0;
+  for(gc_meta *curr = begin->next; curr; curr = curr->next)
+  {
+    if(curr->rrcnt > 0 && !marked(curr))
+    {
+      mark_push(curr);
+      gc_mark_drain(&mark_stack, &list_heap);
+    }
+  }
+  gc_mark_finish(&mark_stack, &list_heap);
+
+  nmarked = mark_count;
+  gc_phase_end(GC_PERF_MARK);
+  if(gc_event_on) { gc_event_instant("mark done", mark_count); }
+  mp_state.store(MP_MARKED, std::memory_order_release);
+}
+
+#ifdef __linux__
+static int mp_clear_dirty()
+{
+  int fd = open("/proc/self/clear_refs", O_WRONLY);
+  if(fd < 0) { return 0; }
+  int ok = write(fd, "4", 1) == 1;
+  close(fd);
+  return ok;
+}
+
+/* Soft-dirty is bit 55 of each /proc/self/pagemap entry. */
+static int mp_rescan_dirty()
+{
+  int fd = open("/proc/self/pagemap", O_RDONLY);
+  if(fd < 0) { return -1; }
+
+  uint64_t entries[512];
+  gclen_t npages = (bump - (char *)test_heap + PAGE_SZ - 1) / PAGE_SZ;
+  gclen_t first = (uintptr_t)test_heap / PAGE_SZ;
+  int first_count = mark_count;
+
+  for(gclen_t base = 0; base < npages; base += 512)
+  {
+    gclen_t n = npages - base < 512 ? npages - base : 512;
+    if(pread(fd, entries, n * sizeof(uint64_t), (first + base) * sizeof(uint64_t)) !=
+       (ssize_t)(n * sizeof(uint64_t)))
+    {
+      close(fd);
+      return -1;
+    }
+
+    for(gclen_t i = 0; i < n; i++)
+    {
+      if(!((entries[i] >> 55) & 1)) { continue; }
+
+      char *page_end = (char *)test_heap + (base + i + 1) * PAGE_SZ;
+      for(gc_meta *obj = page_first[base + i];
+          obj && (char *)obj < page_end && (char *)obj < bump;
+          obj = (gc_meta *)((char *)obj + obj->len))
+      {
+        /* Written since marking started: a new root, or new children. */
+        if(marked(obj)) { mp_scan(&mark_stack, obj); }
+        else if(obj->rrcnt > 0) { mark_push(obj); }
+        gc_mark_drain(&mark_stack, &pause_heap);
+      }
+    }
+  }
+  gc_mark_finish(&mark_stack, &pause_heap);
+
+  close(fd);
+  return mark_count - first_count;
+}
+
+/* Soft-dirty needs CONFIG_MEM_SOFT_DIRTY. Check it works before relying on it. */
+static int mp_init()
+{
+  uint64_t probe[PAGE_SZ / sizeof(uint64_t) * 2];
+  uint64_t *page = (uint64_t *)(((uintptr_t)probe + PAGE_SZ - 1) & ~(uintptr_t)(PAGE_SZ - 1));
+  uint64_t entry = 0;
+
+  if(!mp_clear_dirty()) { return 0; }
+  *(volatile uint64_t *)page = 1;
+
+  int fd = open("/proc/self/pagemap", O_RDONLY);
+  if(fd < 0) { return 0; }
+  int ok = pread(fd, &entry, sizeof(entry), (uintptr_t)page / PAGE_SZ * sizeof(entry)) ==
+           sizeof(entry) && ((entry >> 55) & 1);
+  close(fd);
+  if(!ok) { return 0; }
+
+  mark_bits = (uint64_t *)gc_heap_map(heap_sz / sizeof(align_t) / 8, 0);
+  page_first = (gc_meta **)gc_heap_map(heap_sz / PAGE_SZ * sizeof(gc_meta *), 0);
+  if(!mark_bits || !page_first) { return 0; }
+  page_first[0] = (gc_meta *)test_heap;
+  return 1;
+}
+#else
+static int mp_clear_dirty() { return 0; }
+static int mp_rescan_dirty() { return -1; }
+static int mp_init() { return 0; }
+#endif
+
+/*
+ *  Short pause: sweeps what is left, splices new objects in,
+ *  clears the soft-dirty bits and lets the marker loose.
+ */
+static void mp_start()
+{
+  gc_meta *prev_start = (gc_meta *)test_heap;
+
+  if(gc_event_on) { gc_event_begin("pause"); }
+  gc_phase_cycle_begin();
+
+  gc_phase_begin(GC_PERF_SWEEP);
+  sweep_finish();
+  gc_phase_end(GC_PERF_SWEEP);
+  nfreed = sweep_nfreed;
+  sweep_nfreed = 0;
+  splice_pending(prev_start);
+
+  mp_limit = bump;
+  if(gc_census_on) { gc_census_begin(); }
+  mp_clear_dirty();
+  mp_state.store(MP_MARKING, std::memory_order_release);
+  mp_thread = new std::thread(mp_marker);
+  if(gc_event_on) { gc_event_end("pause"); }
+}
+
+/*
+ *  Final pause: rescan objects on dirty pages and everything
+ *  allocated during marking, then hand off to the sweeper.
+ */
+static void mp_finish()
+{
+  gc_meta *prev_start = (gc_meta *)test_heap;
+
+  if(gc_event_on) { gc_event_begin("pause"); }
+  mp_thread->join();
+  delete mp_thread;
+  mp_thread = 0;
+
+  gc_phase_begin(GC_PERF_MARK);
+  int first_count = mark_count;
+  int dirty_ok = mp_rescan_dirty() >= 0;
+  if(!dirty_ok)
+  {
+    /* Lost pagemap access, so treat every page as dirty. */
+    for(gc_meta *curr = prev_start->next; curr; curr = curr->next)
+    {
+      if(marked(curr)) { mp_scan(&mark_stack, curr); }
+      else if(curr->rrcnt > 0) { mark_push(curr); }
+      gc_mark_drain(&mark_stack, &pause_heap);
+    }
+  }
+
+  /* All live. Those the marker reached sit on dirty pages, so are only scanned again without pagemap. */
+  for(gc_meta *curr = pending; curr; curr = curr->next)
+  {
+    if(!marked(curr)) { mark_push(curr); }
+    else if(!dirty_ok) { mp_scan(&mark_stack, curr); }
+    gc_mark_drain(&mark_stack, &pause_heap);
+  }
+  gc_mark_finish(&mark_stack, &pause_heap);
+  int local_nmarked = mark_count - first_count;
+
+  for(size_t i = 0; i < atomic_young->size(); i++)
+  { atomic_set_marked((*atomic_young)[i] + 1); }
+  atomic_young->clear();
+  local_nmarked += final_scan();
+  gc_phase_end(GC_PERF_MARK);
+  gc_phase_begin(GC_PERF_SWEEP);
+
+  nmarked += local_nmarked;
+  nallocs = 0;
+  gc_sample_reap(sample_is_live);
+  atomic_sweep();
+  if(gc_census_on) { gc_census_end(); }
+  mp_state.store(MP_IDLE, std::memory_order_relaxed);
+  sweep_start(prev_start);
+  gc_phase_end(GC_PERF_SWEEP);
+  gc_phase_cycle_end(nmarked);
+  if(gc_event_on) { gc_event_end("pause"); }
+}
+
+/*
+ *  With wait set, runs a whole cycle. Otherwise only starts
+ *  one, or finishes one whose concurrent mark is done.
+ */
+static void mp_trace(int wait)
+{
+  int state = mp_state.load(std::memory_order_acquire);
+
+  if(state == MP_IDLE)
+  {
+    mp_start();
+    if(!wait) { return; }
+  }
+  else if(state == MP_MARKING && !wait)
+  {
+    nallocs = 0;
+    return;
+  }
+
+  if(gc_event_on) { gc_event_begin("wait marker"); }
+  while(mp_state.load(std::memory_order_acquire) != MP_MARKED)
+  { std::this_thread::yield(); }
+  if(gc_event_on) { gc_event_end("wait marker"); }
+  mp_finish();
+}
+
+#ifdef __linux__
+static std::vector<gc_atomic_meta *> *fork_atomic_dead;
+static uint64_t fork_recs[FORK_BATCH];
+static size_t fork_have;          /* Bytes read into fork_recs */
+static size_t fork_header;        /* Leading records in: the mark count, then any census */
+
+static void fork_write(int fd, uint64_t *recs, size_t n)
+{
+  char *out = (char *)recs;
+  size_t left = n * sizeof(uint64_t);
+
+  while(left)
+  {
+    ssize_t put = write(fd, out, left);
+    if(put < 0 && errno == EINTR) { continue; }
+    if(put <= 0) { _exit(1); }
+    out += put;
+    left -= put;
+  }
+}
+
+/*
+ *  Runs in the child, on a private copy of the heap. Marks
+ *  into the side bitmap with the mostly-parallel marker, so
+ *  the heap pages themselves aren't copied. Sends the mark
+ *  count, then the payload address of every dead object.
+ *  Other threads may have held the malloc lock at the fork,
+ *  so nothing here allocates.
+ */
+static void fork_child(int fd)
 {
-  /* No children */
-  0,
+  gc_meta *begin = (gc_meta *)test_heap;
+  uint64_t recs[FORK_BATCH];
+  size_t n = 0;
 
-  /* gc_tree */
-  4,
-  0, sizeof(void *), 2 * sizeof(void *), 3 * sizeof(void *)
-};
+  /* The counters, rings and locks belong to the parent's threads. */
+  gc_perf_on = 0;
+  gc_event_on = 0;
+  fork_mark = 0;
+  mp_mark = 1;
+  mp_limit = bump;
+  mp_marker();
 
-#define MIN_ALLOCS  0x0008
-#define MAX_ALLOCS  0x4000
-static int alloc_threshold;
-static int nallocs;
+  recs[n++] = nmarked;
+  if(gc_census_on)
+  {
+    for(size_t i = 0; i < GC_CENSUS_KEYS; i++)
+    {
+      recs[n++] = gc_census_now[i].objs;
+      if(n == FORK_BATCH) { fork_write(fd, recs, n); n = 0; }
+      recs[n++] = gc_census_now[i].bytes;
+      if(n == FORK_BATCH) { fork_write(fd, recs, n); n = 0; }
+    }
+  }
 
-void gc_init() 
+  for(gc_meta *curr = begin->next; curr; curr = curr->next)
+  {
+    if(marked(curr)) { continue; }
+    recs[n++] = (uintptr_t)(curr + 1);
+    if(n == FORK_BATCH) { fork_write(fd, recs, n); n = 0; }
+  }
+
+  for(char *curr = atomic_base; curr < atomic_bump; )
+  {
+    gc_atomic_meta *meta = (gc_atomic_meta *)curr;
+    curr += meta->len;
+    if(meta->free || meta->rrcnt > 0 || atomic_marked(meta)) { continue; }
+    recs[n++] = (uintptr_t)(meta + 1);
+    if(n == FORK_BATCH) { fork_write(fd, recs, n); n = 0; }
+  }
+
+  fork_write(fd, recs, n);
+  _exit(0);
+}
+
+/* Hands the dead objects to the sweeper and ends the cycle. */
+static void fork_sweep()
+{
+  gc_phase_begin(GC_PERF_SWEEP);
+  nallocs = 0;
+  gc_sample_reap(sample_is_live);
+  atomic_sweep();
+  if(gc_census_on) { gc_census_end(); }
+  sweep_start((gc_meta *)test_heap);
+  gc_phase_end(GC_PERF_SWEEP);
+  gc_phase_cycle_end(nmarked);
+  fork_reclaim_ms = std::chrono::duration<double, std::milli>(
+                    std::chrono::steady_clock::now() - fork_time).count();
+}
+
+/*
+ *  No pipe or no child this cycle, so mark in the pause. Sets
+ *  the dead flags the sweeper reads in this mode, the next
+ *  cycle forks again.
+ */
+static void fork_mark_here()
 {
   gc_meta *begin = (gc_meta *)test_heap;
-  begin->rrcnt = 1;
-  begin->srtptr = 0;
-  begin->refarray = 0;
-  begin->mark = 1;
-  begin->len = sizeof(gc_meta);
-  begin->next = 0;
 
-  alloc_threshold = MIN_ALLOCS;
-  nallocs = 0;
+  gc_phase_begin(GC_PERF_CLEAR);
+  for(gc_meta *curr = begin->next; curr; curr = curr->next) { curr->dead = 1; }
+  gc_phase_end(GC_PERF_CLEAR);
+  gc_phase_begin(GC_PERF_MARK);
+
+  mark_count = 0;
+  for(gc_meta *curr = begin->next; curr; curr = curr->next)
+  {
+    if(curr->rrcnt > 0 && !marked(curr))
+    {
+      mark_push(curr);
+      gc_mark_drain(&mark_stack, &pause_heap);
+    }
+  }
+  gc_mark_finish(&mark_stack, &pause_heap);
+  final_scan();
+  nmarked = mark_count;
+  gc_phase_end(GC_PERF_MARK);
+  fork_sweep();
 }
 
-void *gc_create_ref(gclen_t len, gclen_t srtptr, int flags)
+/*
+ *  Short pause: sweeps what is left, splices new objects in
+ *  and forks. Marks in place if there's no pipe or child.
+ */
+static void fork_start()
 {
-  gclen_t true_len = (len + sizeof(gc_meta) + sizeof(align_t) - 1) &
-                     ~(sizeof(align_t) - 1);
+  gc_meta *prev_start = (gc_meta *)test_heap;
+  int fds[2];
 
-  gc_meta *prev = (gc_meta *)test_heap;
-  gc_meta *curr = (gc_meta *)prev->next;
-  char *region = (char *)(prev + 1);
+  fork_time = std::chrono::steady_clock::now();
+  gc_phase_begin(GC_PERF_SWEEP);
+  sweep_finish();
+  gc_phase_end(GC_PERF_SWEEP);
+  nfreed = sweep_nfreed;
+  sweep_nfreed = 0;
+  splice_pending(prev_start);
 
-  if(nallocs >= alloc_threshold)
+  if(!fork_atomic_dead) { fork_atomic_dead = new std::vector<gc_atomic_meta *>(); }
+  if(gc_census_on) { gc_census_begin(); }
+  if(pipe(fds))
   {
-    gc_trace();
-    int local_nallocs = nallocs;
-    int local_threshold = alloc_threshold;
+    fork_mark_here();
+    return;
+  }
 
-    if(local_threshold >= local_nallocs / 2 && local_threshold * 2 <= MAX_ALLOCS)
-    { local_threshold *= 2; }
-    else if(local_threshold <= local_nallocs / 4 && local_threshold / 2 >= MIN_ALLOCS)
-    { local_threshold /= 2; }
+  fflush(stdout);
+  pid_t pid = fork();
+  if(pid == 0)
+  {
+    close(fds[0]);
+    fork_child(fds[1]);
+  }
+  close(fds[1]);
+  if(pid < 0)
+  {
+    close(fds[0]);
+    fork_mark_here();
+    return;
   }
 
-  /* Find space in between two nodes. */
-  while(curr)
+  fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+  fork_pid = pid;
+  fork_fd = fds[0];
+  fork_have = 0;
+  fork_header = 0;
+  fork_pause_ms = std::chrono::duration<double, std::milli>(
+                  std::chrono::steady_clock::now() - fork_time).count();
+}
+
+/* Flags what the child has sent so far. Returns 1 once it is done. */
+static int fork_drain(int wait)
+{
+  while(1)
   {
-    if(region + true_len < (char *)curr)
+    ssize_t got = read(fork_fd, (char *)fork_recs + fork_have, sizeof(fork_recs) - fork_have);
+    if(got == 0) { return 1; }
+    if(got < 0)
     {
-      gc_meta *retmeta = (gc_meta *)region;
-      memset(retmeta + 1, 0, len);
-      retmeta->rrcnt = flags & ROOT_FLAG ? 1 : 0;
-      retmeta->srtptr = srtptr;
-      retmeta->refarray = flags & REFARRAY_FLAG ? 1 : 0;
-      retmeta->mark = 0;
-      retmeta->len = true_len;
-      retmeta->next = curr;
-      prev->next = retmeta;
+      if(errno == EINTR) { continue; }
+      if(errno != EAGAIN) { return 1; }
+      if(!wait) { return 0; }
 
-      nallocs++;
-      return retmeta + 1;
+      pollfd ready = {fork_fd, POLLIN, 0};
+      poll(&ready, 1, -1);
+      continue;
     }
 
-    prev = curr;
-    region = (char *)prev + prev->len;
-    curr = curr->next;
-  }
-
-  /* If no space to sandwich between, try to allocate at end. */
-  if(!curr && region + true_len < (char *)test_heap + heap_sz)
-  {
-    gc_meta *retmeta = (gc_meta *)region;
-    memset(retmeta + 1, 0, len);
-    retmeta->rrcnt = flags & ROOT_FLAG ? 1 : 0;
-    retmeta->srtptr = srtptr;
-    retmeta->refarray = flags & REFARRAY_FLAG ? 1 : 0;
-    retmeta->mark = 0;
-    retmeta->len = true_len;
-    retmeta->next = 0;
-    prev->next = retmeta;
+    fork_have += got;
+    size_t nrecs = fork_have / sizeof(uint64_t);
+    size_t nheader = 1 + (gc_census_on ? 2 * GC_CENSUS_KEYS : 0);
+    for(size_t i = 0; i < nrecs; i++)
+    {
+      void *obj = (void *)(uintptr_t)fork_recs[i];
+      if(fork_header < nheader)
+      {
+        if(fork_header == 0) { nmarked = (int)fork_recs[i]; }
+        else
+        {
+          gc_census_count *count = &gc_census_now[(fork_header - 1) / 2];
+          if(fork_header % 2) { count->objs = fork_recs[i]; }
+          else { count->bytes = fork_recs[i]; }
+        }
+        fork_header++;
+      }
+      else if(atomic_obj(obj)) { fork_atomic_dead->push_back((gc_atomic_meta *)obj - 1); }
+      else { ((gc_meta *)obj - 1)->dead = 1; }
+    }
 
-    nallocs++;
-    return retmeta + 1;
+    fork_have -= nrecs * sizeof(uint64_t);
+    memmove(fork_recs, (char *)fork_recs + nrecs * sizeof(uint64_t), fork_have);
   }
-
-  return 0;
 }
 
-void gc_dec_rrcnt(void *alloc)
+/*
+ *  Everything the child sent is dead even if it died halfway,
+ *  so a failed child only means less is freed this cycle.
+ */
+static void fork_finish()
 {
-  gc_meta *retmeta = ((gc_meta *)alloc) - 1;
-  if(alloc) { retmeta->rrcnt--; } 
+  int status;
+
+  close(fork_fd);
+  waitpid(fork_pid, &status, 0);
+  fork_pid = 0;
+
+  gc_phase_begin(GC_PERF_MARK);
+
+  /* Atomic objects are live unless reported, including any allocated since the fork. */
+  gclen_t nbits = (align_t *)atomic_bump - (align_t *)atomic_base;
+  memset(atomic_bits, 0xff, (nbits + 63) / 64 * sizeof(uint64_t));
+  for(size_t i = 0; i < fork_atomic_dead->size(); i++)
+  {
+    gclen_t bit = (align_t *)(*fork_atomic_dead)[i] - (align_t *)atomic_base;
+    atomic_bits[bit / 64] &= ~((uint64_t)1 << (bit % 64));
+  }
+  fork_atomic_dead->clear();
+  nmarked += final_scan();
+  gc_phase_end(GC_PERF_MARK);
+  fork_sweep();
 }
 
-void gc_inc_rrcnt(void *alloc)
+/*
+ *  With wait set, runs a whole cycle. Otherwise only starts
+ *  one, or reads what the child has sent and finishes the
+ *  cycle if it is done.
+ */
+static void fork_trace(int wait)
 {
-  gc_meta *retmeta = ((gc_meta *)alloc) - 1;
-  if(alloc) { retmeta->rrcnt++; }
+  if(!fork_pid)
+  {
+    if(gc_event_on) { gc_event_begin("pause"); }
+    gc_phase_cycle_begin();
+    fork_start();
+    if(gc_event_on) { gc_event_end("pause"); }
+    if(!wait || !fork_pid) { return; }
+  }
+
+  /* The parent's share of marking: flagging what the child reports, or waiting on it. */
+  gc_phase_begin(GC_PERF_MARK);
+  int done = fork_drain(wait);
+  gc_phase_end(GC_PERF_MARK);
+  if(!done)
+  {
+    nallocs = 0;
+    return;
+  }
+  if(gc_event_on)
+  {
+    gc_event_instant("child done", 0);
+    gc_event_begin("pause");
+  }
+  fork_finish();
+  if(gc_event_on) { gc_event_end("pause"); }
 }
+#else
+static void fork_start() {}
+static void fork_trace(int wait) { (void)wait; }
+#endif
 
 void gc_trace()
 {
@@ -131,13 +1571,44 @@ void gc_trace()
   gc_meta *start = prev_start->next;
   gc_meta *curr, *prev;
 
-  curr = start;
+  if(mp_mark)
+  {
+    mp_trace(1);
+    return;
+  }
+  if(fork_mark)
+  {
+    fork_trace(1);
+    return;
+  }
+
+  if(gc_event_on) { gc_event_begin("pause"); }
+  gc_phase_cycle_begin();
+
+  /* The previous sweep must be done, it also cleared the marks. */
+  if(bg_sweep)
+  {
+    gc_phase_begin(GC_PERF_SWEEP);
+    sweep_finish();
+    gc_phase_end(GC_PERF_SWEEP);
+    nfreed = sweep_nfreed;
+    sweep_nfreed = 0;
+    start = splice_pending(prev_start);
+  }
+
+  if(!bg_sweep) { gc_phase_begin(GC_PERF_CLEAR); }
+  curr = bg_sweep ? 0 : start;
   while(curr)
   { 
     curr->mark = 0; 
     curr = curr->next; 
   }
+  if(!bg_sweep) { gc_phase_end(GC_PERF_CLEAR); }
+  gc_phase_begin(GC_PERF_MARK);
+
+  if(gc_census_on) { gc_census_begin(); }
 
+  int local_nmarked = 0;
   curr = start;
   while(curr)
   {
@@ -157,6 +1628,8 @@ void gc_trace()
           for(gclen_t i = 0; i < nchildren; i++)
           {
             gc_meta *check_mark = (gc_meta *)children[i];
+            if(atomic_obj(check_mark)) { atomic_set_marked(check_mark); continue; }
+            if(image_obj(check_mark)) { continue; }
             if(check_mark-- && !check_mark->mark)
             {
               check_mark->trace_next = curr_trace->trace_next;
@@ -172,6 +1645,8 @@ void gc_trace()
           for(gclen_t i = curr_trace->srtptr + 1; nchildren--; i++)
           {
             gc_meta *check_mark = *(gc_meta **)(base + strong_table[i]);
+            if(atomic_obj(check_mark)) { atomic_set_marked(check_mark); continue; }
+            if(image_obj(check_mark)) { continue; }
             if(check_mark-- && !check_mark->mark)
             {
               check_mark->trace_next = curr_trace->trace_next;
@@ -181,41 +1656,482 @@ void gc_trace()
           }
         }
 
+        census(curr_trace);
+        local_nmarked++;
         curr_trace = curr_trace->trace_next;
       }
     }
     curr = curr->next;
   }
+  nmarked = local_nmarked + final_scan();
+  gc_phase_end(GC_PERF_MARK);
+  gc_phase_begin(GC_PERF_SWEEP);
+  gc_sample_reap(sample_is_live);
+
+  if(bg_sweep)
+  {
+    nallocs = 0;
+    atomic_sweep();
+    if(gc_census_on) { gc_census_end(); }
+    sweep_start(prev_start);
+    gc_phase_end(GC_PERF_SWEEP);
+    gc_phase_cycle_end(nmarked);
+    if(gc_event_on) { gc_event_end("pause"); }
+    return;
+  }
 
   prev = prev_start;
   curr = start;
-  int local_nallocs = nallocs;
+  int local_nfreed = 0;
+  gc_heap_run dead = { 0, 0 };
   while(curr)
   {
+    gc_meta *next = curr->next;
     if(!curr->mark) 
     { 
-      prev->next = curr->next;
-      local_nallocs--; 
+      prev->next = next;
+      local_nfreed++; 
+      heap_used -= curr->len;
+      if(curr->buffer) { gc_buffer_release((gc_buffer *)(curr + 1)); }
+
+      /* Header too, the next object may start anywhere in the gap. */
+      gc_heap_zero_add(&dead, curr, curr->len);
     }
     else { prev = curr; }
-    curr = curr->next;
+    curr = next;
   }
-  nallocs = local_nallocs;
+  gc_heap_zero_flush(&dead);
+  nfreed = local_nfreed;
+  nallocs = 0;
+  rover = prev_start;
+  atomic_sweep();
+  if(gc_census_on) { gc_census_end(); }
+  gc_phase_end(GC_PERF_SWEEP);
+  gc_phase_cycle_end(nmarked);
+  if(gc_event_on) { gc_event_end("pause"); }
 
 //  DEBUG_ASSERT(!prev_start->next);
 }
 
-int main() 
+/* Bytes the object takes in an image, always behind a gc_meta. */
+static gclen_t image_len(void *alloc)
+{
+  if(atomic_obj(alloc))
+  { return sizeof(gc_meta) + ((gc_atomic_meta *)alloc)[-1].len - sizeof(gc_atomic_meta); }
+  return ((gc_meta *)alloc)[-1].len;
+}
+
+/* Offsets of the strong references in the payload. Atomic objects have none. */
+static void image_slots(void *alloc, std::vector<gclen_t> &slots)
+{
+  slots.clear();
+  if(atomic_obj(alloc)) { return; }
+
+  gc_meta *meta = (gc_meta *)alloc - 1;
+  if(meta->refarray)
+  {
+    for(gclen_t i = 0; i < meta->srtptr; i++) { slots.push_back(i * sizeof(void *)); }
+    return;
+  }
+  gclen_t nchildren = strong_table[meta->srtptr];
+  for(gclen_t i = meta->srtptr + 1; nchildren--; i++) { slots.push_back(strong_table[i]); }
+}
+
+/*
+ *  Copies root and everything it reaches into an image, in
+ *  breadth-first order. Atomic objects become leaves like any
+ *  other. Buffers can't be saved, their payload isn't in the
+ *  heap. Returns -1 on failure.
+ */
+int gc_save_image(const char *path, void *root)
+{
+  if(!root) { return -1; }
+
+  std::unordered_map<void *, uint64_t> where;    /* Payload to its offset in the image */
+  std::vector<void *> objs(1, root);
+  std::vector<gclen_t> slots;
+  uint64_t at = IMAGE_PAGE;
+
+  where[root] = 0;
+  for(size_t i = 0; i < objs.size(); i++)
+  {
+    void *alloc = objs[i];
+    if(!atomic_obj(alloc) && ((gc_meta *)alloc)[-1].buffer) { return -1; }
+
+    where[alloc] = at + sizeof(gc_meta);
+    at += image_len(alloc);
+
+    image_slots(alloc, slots);
+    for(size_t j = 0; j < slots.size(); j++)
+    {
+      void *child = *(void **)((char *)alloc + slots[j]);
+      if(child && !where.count(child))
+      {
+        where[child] = 0;
+        objs.push_back(child);
+      }
+    }
+  }
+
+  FILE *out = fopen(path, "wb");
+  if(!out) { return -1; }
+
+  image_header hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, IMAGE_MAGIC, 4);
+  hdr.version = IMAGE_VERSION;
+  hdr.base = IMAGE_BASE;
+  hdr.root = where[root];
+  hdr.objs = IMAGE_PAGE;
+  hdr.objs_len = at - IMAGE_PAGE;
+  fseek(out, IMAGE_PAGE, SEEK_SET);
+
+  std::vector<uint64_t> relocs;
+  std::vector<char> payload;
+  for(size_t i = 0; i < objs.size(); i++)
+  {
+    void *alloc = objs[i];
+    gclen_t len = image_len(alloc);
+
+    gc_meta meta;
+    memset(&meta, 0, sizeof(meta));
+    meta.srtptr = atomic_obj(alloc) ? 0 : ((gc_meta *)alloc)[-1].srtptr;
+    meta.refarray = atomic_obj(alloc) ? 0 : ((gc_meta *)alloc)[-1].refarray;
+    meta.mark = 1;
+    meta.len = len;
+
+    payload.assign((char *)alloc, (char *)alloc + len - sizeof(gc_meta));
+    image_slots(alloc, slots);
+    for(size_t j = 0; j < slots.size(); j++)
+    {
+      void **field = (void **)(&payload[0] + slots[j]);
+      if(!*field) { continue; }
+      *field = (void *)(uintptr_t)(IMAGE_BASE + where[*field]);
+      relocs.push_back(where[alloc] + slots[j]);
+    }
+
+    fwrite(&meta, sizeof(meta), 1, out);
+    if(payload.size()) { fwrite(&payload[0], 1, payload.size(), out); }
+  }
+
+  hdr.relocs = at;
+  hdr.nrelocs = relocs.size();
+  if(relocs.size()) { fwrite(&relocs[0], sizeof(uint64_t), relocs.size(), out); }
+  hdr.types = hdr.relocs + hdr.nrelocs * sizeof(uint64_t);
+  hdr.ntypes = sizeof(strong_table) / sizeof(strong_table[0]);
+  fwrite(strong_table, sizeof(gclen_t), hdr.ntypes, out);
+  hdr.size = hdr.types + hdr.ntypes * sizeof(gclen_t);
+
+  fseek(out, 0, SEEK_SET);
+  fwrite(&hdr, sizeof(hdr), 1, out);
+  if(ferror(out))
+  {
+    fclose(out);
+    return -1;
+  }
+  return fclose(out) ? -1 : 0;
+}
+
+#ifdef __linux__
+static int image_valid(const image_header *hdr, uint64_t file_sz)
+{
+  uint64_t ntypes = sizeof(strong_table) / sizeof(strong_table[0]);
+
+  return !memcmp(hdr->magic, IMAGE_MAGIC, 4) && hdr->version == IMAGE_VERSION &&
+         hdr->size == file_sz && hdr->objs == IMAGE_PAGE &&
+         hdr->root > hdr->objs && hdr->root < hdr->objs + hdr->objs_len &&
+         hdr->relocs == hdr->objs + hdr->objs_len &&
+         hdr->types == hdr->relocs + hdr->nrelocs * sizeof(uint64_t) &&
+         hdr->ntypes == ntypes && hdr->size == hdr->types + ntypes * sizeof(gclen_t);
+}
+
+/*
+ *  Maps an image saved with the same strong table and returns
+ *  its root, 0 if it can't. Only one image can be loaded.
+ */
+void *gc_load_image(const char *path)
+{
+  if(image_base) { return 0; }
+
+  int fd = open(path, O_RDONLY);
+  if(fd < 0) { return 0; }
+
+  image_header hdr;
+  struct stat st;
+  if(fstat(fd, &st) || pread(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr) ||
+     !image_valid(&hdr, st.st_size))
+  {
+    close(fd);
+    return 0;
+  }
+
+  char *map = (char *)mmap((void *)(uintptr_t)hdr.base, hdr.size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED) { return 0; }
+
+  if(memcmp(map + hdr.types, strong_table, hdr.ntypes * sizeof(gclen_t)))
+  {
+    munmap(map, hdr.size);
+    return 0;
+  }
+
+  if((uintptr_t)map != hdr.base)
+  {
+    uint64_t delta = (uintptr_t)map - hdr.base;
+    uint64_t *relocs = (uint64_t *)(map + hdr.relocs);
+    for(uint64_t i = 0; i < hdr.nrelocs; i++)
+    {
+      if(relocs[i] < hdr.objs || relocs[i] > hdr.relocs - sizeof(uint64_t))
+      {
+        munmap(map, hdr.size);
+        return 0;
+      }
+      *(uint64_t *)(map + relocs[i]) += delta;
+    }
+  }
+
+  image_base = map;
+  image_end = map + hdr.size;
+  return map + hdr.root;
+}
+#else
+void *gc_load_image(const char *path) { (void)path; return 0; }
+#endif
+
+/*
+ *  Mark-time benchmark for heap page sizes:
+ *
+ *    GC_HEAP_PAGES=small   ./gc_stwtrace bench [nobjs]
+ *    GC_HEAP_PAGES=thp     ./gc_stwtrace bench [nobjs]
+ *    GC_HEAP_PAGES=hugetlb ./gc_stwtrace bench [nobjs]
+ *
+ *  Builds one long gc_tree chain linked in shuffled address
+ *  order so the marker hops between pages, then times gc_trace.
+ *  With GC_FORK_MARK=1 the trace time is the fork pause and
+ *  reclaim is the time from the fork to the sweep hand off.
+ */
+static int gc_bench(long nobjs)
+{
+  const int ntraces = 8;
+  if(nobjs < 1) { nobjs = 1; }
+  gc_tree **order = (gc_tree **)malloc(nobjs * sizeof(gc_tree *));
+  gc_tree *root = (gc_tree *)gc_create_ref(sizeof (gc_tree), 1, ROOT_FLAG);
+  gc_tree *tail = root;
+
+  for(long i = 0; i < nobjs; i++)
+  {
+    tail->next = (gc_tree *)gc_create_ref(sizeof (gc_tree), 1, 0);
+    if(!tail->next) { printf("heap full after %ld objects\n", i); return 1; }
+    tail = order[i] = tail->next;
+  }
+
+  srand(1);
+  for(long i = nobjs - 1; i > 0; i--)
+  {
+    long j = ((long)rand() * RAND_MAX + rand()) % (i + 1);
+    gc_tree *swap = order[i]; order[i] = order[j]; order[j] = swap;
+  }
+  root->next = order[0];
+  for(long i = 0; i < nobjs - 1; i++) { order[i]->next = order[i + 1]; }
+  order[nobjs - 1]->next = 0;
+  free(order);
+
+  int dtlb_counter = gc_perf_counter_open(GC_PERF_DTLB_MISSES);
+
+  /* Pause only: let a background sweep finish outside the timed region. */
+  std::chrono::duration<double, std::milli> elapsed(0);
+  double reclaim = 0;
+  for(int i = 0; i < ntraces; i++)
+  {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if(mp_mark)
+    {
+      /* Both mostly-parallel pauses, but not the concurrent mark. */
+      mp_start();
+      elapsed += std::chrono::steady_clock::now() - start;
+      while(mp_state.load() != MP_MARKED) { std::this_thread::yield(); }
+      start = std::chrono::steady_clock::now();
+      mp_finish();
+    }
+    else if(fork_mark)
+    {
+      /* The fork is the pause, the child marks and the sweeper frees. */
+      gc_trace();
+      elapsed += std::chrono::duration<double, std::milli>(fork_pause_ms);
+      reclaim += fork_reclaim_ms;
+      start = std::chrono::steady_clock::now();
+    }
+    else { gc_trace(); }
+    elapsed += std::chrono::steady_clock::now() - start;
+    while(sweep_active.load()) { std::this_thread::yield(); }
+  }
+
+  int64_t dtlb = gc_perf_counter_read(dtlb_counter);
+  gc_perf_counter_close(dtlb_counter);
+
+  const char *pages = getenv("GC_HEAP_PAGES");
+  printf("pages=%s sweep=%s mark=%s objs=%ld trace=%.2f ms", pages ? pages : "thp",
+         bg_sweep ? "background" : "inline",
+         mp_mark ? "mostly-parallel" : fork_mark ? "fork" : "stw",
+         nobjs, elapsed.count() / ntraces);
+  if(fork_mark) { printf(" reclaim=%.2f ms", reclaim / ntraces); }
+  if(dtlb >= 0) { printf(" dtlb_misses=%lld", (long long)(dtlb / ntraces)); }
+  printf("\n");
+
+  return 0;
+}
+
+/*
+ *  Buffer round trip: ./gc_stwtrace cat <file> reads the file
+ *  into collected buffers and sends them to stdout, without
+ *  the bytes ever entering the heap.
+ */
+#ifdef __linux__
+static int gc_cat(const char *path)
+{
+  const int nbufs = 4;
+  int fd = open(path, O_RDONLY);
+  if(fd < 0) { perror(path); return 1; }
+
+  while(1)
+  {
+    gc_buffer *bufs[nbufs];
+    for(int i = 0; i < nbufs; i++)
+    {
+      bufs[i] = gc_create_buffer(64 * 1024, ROOT_FLAG);
+      if(!bufs[i]) { printf("out of buffers\n"); return 1; }
+    }
+
+    ssize_t got = gc_buffer_readv(fd, bufs, nbufs);
+    if(got < 0) { perror(path); return 1; }
+
+    for(int i = 0; i < nbufs; i++)
+    {
+      for(size_t sent = 0; sent < bufs[i]->len; )
+      {
+        ssize_t n = gc_buffer_sendfile(1, bufs[i], sent, bufs[i]->len - sent);
+        if(n <= 0) { perror("sendfile"); return 1; }
+        sent += n;
+      }
+      gc_dec_rrcnt(bufs[i]);
+    }
+
+    if(!got) { break; }
+  }
+
+  close(fd);
+  return 0;
+}
+#endif
+
+/*
+ *  Startup from an image:
+ *
+ *    ./gc_stwtrace image save <path> [nobjs]
+ *    ./gc_stwtrace image load <path>
+ *
+ *  save builds a gc_tree of nobjs nodes, eight children each,
+ *  and writes it out. load maps it back instead. Both then walk
+ *  the tree and time a trace, which never enters the image.
+ */
+static long image_walk(gc_tree *root)
+{
+  std::vector<gc_tree *> rem(1, root);
+  long n = 0;
+
+  while(rem.size())
+  {
+    gc_tree *node = rem.back();
+    rem.pop_back();
+    n++;
+    for(gc_tree *child = node->children; child; child = child->next) { rem.push_back(child); }
+  }
+  return n;
+}
+
+static int gc_image(int save, const char *path, long nobjs)
+{
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  gc_tree *root;
+
+  if(save)
+  {
+    if(nobjs < 1) { nobjs = 1; }
+    gc_tree **nodes = (gc_tree **)malloc(nobjs * sizeof(gc_tree *));
+    root = nodes[0] = (gc_tree *)gc_create_ref(sizeof (gc_tree), 1, ROOT_FLAG);
+    for(long i = 1; i < nobjs; i++)
+    {
+      gc_tree *node = (gc_tree *)gc_create_ref(sizeof (gc_tree), 1, 0);
+      if(!node) { printf("heap full after %ld objects\n", i); return 1; }
+
+      gc_tree *parent = nodes[(i - 1) / 8];
+      node->parent = parent;
+      node->next = parent->children;
+      parent->children = node;
+      nodes[i] = node;
+    }
+    free(nodes);
+  }
+  else
+  {
+    root = (gc_tree *)gc_load_image(path);
+    if(!root) { printf("%s: not an image for this collector\n", path); return 1; }
+  }
+  std::chrono::duration<double, std::milli> ready = std::chrono::steady_clock::now() - start;
+
+  start = std::chrono::steady_clock::now();
+  long n = image_walk(root);
+  std::chrono::duration<double, std::milli> walked = std::chrono::steady_clock::now() - start;
+
+  if(save && gc_save_image(path, root)) { perror(path); return 1; }
+
+  start = std::chrono::steady_clock::now();
+  gc_trace();
+  std::chrono::duration<double, std::milli> traced = std::chrono::steady_clock::now() - start;
+
+  printf("%s: %ld nodes, %s=%.2f ms walk=%.2f ms trace=%.2f ms\n", path, n,
+         save ? "build" : "map", ready.count(), walked.count(), traced.count());
+  return 0;
+}
+
+/* ./gc_stwtrace replay <trace> runs a GC_RECORD trace against this collector. */
+static void *replay_create(size_t len, size_t type, int flags)
+{ return gc_create_ref(len, type, flags); }
+
+static void *replay_create_atomic(size_t len, int flags)
+{ return gc_create_atomic(len, flags); }
+
+static void replay_store(void *obj, size_t offset, void *value)
+{ gc_store_ref(obj, offset, value); }
+
+static const gc_replay_ops replay_ops =
+{
+  replay_create, replay_create_atomic, gc_inc_rrcnt, gc_dec_rrcnt, replay_store, gc_trace
+};
+
+int main(int argc, char **argv) 
 {
   gc_init();
 
+  if(argc > 1 && !strcmp(argv[1], "bench"))
+  { return gc_bench(argc > 2 ? atol(argv[2]) : 1 << 22); }
+#ifdef __linux__
+  if(argc > 2 && !strcmp(argv[1], "cat")) { return gc_cat(argv[2]); }
+#endif
+  if(argc > 2 && !strcmp(argv[1], "replay")) { return gc_replay(argv[2], &replay_ops); }
+  if(argc > 3 && !strcmp(argv[1], "image"))
+  { return gc_image(!strcmp(argv[2], "save"), argv[3], argc > 4 ? atol(argv[4]) : 1 << 20); }
+
+  gc_census_name(1, "gc_tree");
+
   while(1)
   {
     gc_tree *root = (gc_tree *)gc_create_ref(sizeof (gc_tree), 1, ROOT_FLAG);
-    root->children = (gc_tree *)gc_create_ref(sizeof (gc_tree), 1, 0);
-    root->children->parent = root;
-    root->children->next = (gc_tree *)gc_create_ref(sizeof (gc_tree), 1, 0);
-    root->children->next->parent = root;
+    gc_store_ref(root, offsetof(gc_tree, children), gc_create_ref(sizeof (gc_tree), 1, 0));
+    gc_store_ref(root->children, offsetof(gc_tree, parent), root);
+    gc_store_ref(root->children, offsetof(gc_tree, next), gc_create_ref(sizeof (gc_tree), 1, 0));
+    gc_store_ref(root->children->next, offsetof(gc_tree, parent), root);
     gc_dec_rrcnt(root);
     printf("%p\r\n", (void *)root);
   } 
@@ -9,6 +9,7 @@
  */
 
 #include <stdint.h>
+#include "gc_limit.hpp"
 
 typedef int64_t gcrcnt_t;
 typedef uint64_t gclen_t;
@@ -20,6 +21,8 @@ struct gc_meta
   gclen_t srtptr : 60;
   gclen_t refarray : 1;
   gclen_t mark     : 1;
+  gclen_t buffer   : 1;   /* Holds a gc_buffer, release its payload when swept */
+  gclen_t dead     : 1;   /* Unreachable in the last fork snapshot */
   gclen_t len;
   gc_meta *next;
   gc_meta *trace_next;
@@ -27,13 +30,47 @@ struct gc_meta
 
 #define ROOT_FLAG     1
 #define REFARRAY_FLAG 2
+#define ZERO_FLAG     4   /* gc_create_atomic only, atomic objects aren't zeroed by default */
 
 void gc_init();
 void *gc_create_ref(gclen_t len, gclen_t srtptr, int flags);
+void *gc_create_atomic(gclen_t len, int flags);
 void gc_dec_rrcnt(void *alloc);
 void gc_inc_rrcnt(void *alloc);
+void gc_store_ref(void *alloc, gclen_t offset, void *value);
 void gc_trace();
 
+struct gc_buffer;
+gc_buffer *gc_create_buffer(gclen_t cap, int flags);
+
+/*
+ *  Finalization. fn(alloc, data) runs once, some time after
+ *  alloc is found unreachable: on the finalizer thread if
+ *  GC_FINALIZER_THREAD=1 was set at gc_init, otherwise from
+ *  gc_run_finalizers (max 0 runs everything queued). The
+ *  object and what it refers to stay valid until fn returns,
+ *  and are freed by a later trace. Finalizers on the thread
+ *  must not call into the collector. Atomic and image objects
+ *  can't be registered.
+ */
+typedef void (*gc_finalizer_fn)(void *alloc, void *data);
+int gc_register_finalizer(void *alloc, gc_finalizer_fn fn, void *data);
+int gc_run_finalizers(int max);
+
+/*
+ *  Heap images. gc_save_image writes root and everything it
+ *  reaches to a file. gc_load_image maps one back (Linux only)
+ *  and returns its root, without allocating or copying: pages
+ *  fault in as they are touched. Image objects are never
+ *  traced or freed. They may be written, but a collected
+ *  object stored into one must go through gc_store_ref, which
+ *  keeps it alive as a root until it is overwritten. Loading
+ *  fails if the strong table changed since saving, and only
+ *  one image can be loaded.
+ */
+int gc_save_image(const char *path, void *root);
+void *gc_load_image(const char *path);
+
 
 
 #endif
\ No newline at end of file
@@ -1,7 +1,12 @@
 #include "gcproto.hpp"
+#include "gc_record.hpp"
+#include "gc_perf.hpp"
+#include "gc_mark.hpp"
 #include <vector>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
 
 using std::vector;
 
@@ -47,8 +52,96 @@ static gcofs_t agg_table[] =
 static gc_meta *begin;
 static align_t test_heap[HEAP_SZ / sizeof(align_t)];
 
-void *gc_create_ref(gclen_t len, gcofs_t atptr, int flags)
+/*
+ *  The mark stack lives beside the heap. Tracing and the RC
+ *  walks share it, it is set up by gc_rc_enable or the first
+ *  collection. It covers most of the test heap's objects, deep
+ *  or wide heaps beyond that are rescanned on overflow.
+ */
+#define MARK_STACK_SZ (64 << 10)
+
+static gc_mark_stack mark_stack;
+static gc_mark_segment mark_space[MARK_STACK_SZ / sizeof(gc_mark_segment)];
+
+/*
+ *  Reference counting mode. Counts cover every reference,
+ *  stores go through gc_store_ref and objects are freed as
+ *  soon as they drop to zero. Decrements that leave a count
+ *  above zero buffer the object as a possible cycle root for
+ *  the trial deletion pass (Bacon and Rajan, 2001).
+ */
+
+#define RC_BLACK  0     /* In use or free */
+#define RC_GRAY   1     /* Possible member of cycle */
+#define RC_WHITE  2     /* Member of garbage cycle */
+#define RC_PURPLE 3     /* Possible root of cycle */
+
+#define RC_ROOTS_MAX 4096
+
+static int rc_mode;
+static gc_meta *rc_roots[RC_ROOTS_MAX];
+static size_t rc_nroots;
+static int rc_roots_dropped;   /* A candidate found the buffer full and is only colored purple */
+static int rc_freed;           /* Freed since weak references were last cleared */
+
+static void rc_collect_cycles();
+
+/*
+ *  A new object has no references until the caller stores
+ *  one, so it can't be freed for being at zero. Objects made
+ *  with a zero count wait in this table and are released by
+ *  gc_collect, never from inside another call. There is room
+ *  for every object the heap can hold.
+ */
+#define RC_ZCT_MAX (HEAP_SZ / sizeof(gc_meta))
+
+static gc_meta *rc_zct[RC_ZCT_MAX];
+static size_t rc_nzct;
+
+/*
+ *  Free memory is kept zeroed, so allocation needn't clear
+ *  it. gc_destroy_ref zeroes the payload at once, but the
+ *  header still links the sweep along and tells weak
+ *  references the object is gone. It waits here and is
+ *  cleared before the next allocation, once those are done.
+ */
+static gc_meta *dead_headers[RC_ZCT_MAX];
+static size_t ndead_headers;
+
+/*
+ *  Every live weak reference and ephemeron, so weak processing
+ *  costs the number of weak objects rather than the heap. A
+ *  weak object's atptr is its index here.
+ */
+struct gc_weak_entry
+{
+  gc_meta *obj;
+  int ephemeron;
+};
+
+static vector<gc_weak_entry> weak_table;
+
+/* Soft heap limit, see gc_limit.hpp. */
+#define SOFT_MIN_BUDGET ((gclen_t)4 << 10)
+
+static gclen_t heap_used;      /* Bytes in live and not yet collected objects */
+
+static uint64_t soft_used() { return heap_used; }
+const gc_limit_ops gc_limit_collector = { SOFT_MIN_BUDGET, soft_used };
+
+static void collect_all(int dump);
+
+static void clear_dead_headers()
 {
+  for(size_t i = 0; i < ndead_headers; i++)
+  { memset(dead_headers[i], 0, sizeof(gc_meta)); }
+  ndead_headers = 0;
+}
+
+static void *gc_alloc(gclen_t len, gcofs_t atptr, int flags)
+{
+  clear_dead_headers();
+
   /* Go through heap and look for space. */
   gclen_t true_len = (len + sizeof(gc_meta) + (sizeof(align_t) - 1)) & 
                      ~(sizeof(align_t) - 1);
@@ -77,8 +170,7 @@ void *gc_create_ref(gclen_t len, gcofs_t atptr, int flags)
       retmeta->collected = 0;
       retmeta->rrcnt = flags & ROOT_FLAG ? 1 : 0;
       retmeta->refarray = flags & REFARRAY_FLAG ? 1 : 0;
-      retmeta->weakref = flags & WEAKREF_FLAG ? 1 : 0;
-      memset(retmeta + 1, 0, len);
+      retmeta->weakref = flags & (WEAKREF_FLAG | EPHEMERON_FLAG) ? 1 : 0;
 
       return retmeta + 1;
     }
@@ -100,8 +192,7 @@ void *gc_create_ref(gclen_t len, gcofs_t atptr, int flags)
       retmeta->collected = 0;
       retmeta->rrcnt = flags & ROOT_FLAG ? 1 : 0;
       retmeta->refarray = flags & REFARRAY_FLAG ? 1 : 0;
-      retmeta->weakref = flags & WEAKREF_FLAG ? 1 : 0;
-      memset(retmeta + 1, 0, len);
+      retmeta->weakref = flags & (WEAKREF_FLAG | EPHEMERON_FLAG) ? 1 : 0;
 
       return retmeta + 1;
     } 
@@ -117,8 +208,7 @@ void *gc_create_ref(gclen_t len, gcofs_t atptr, int flags)
       begin->collected = 0;
       begin->rrcnt = flags & ROOT_FLAG ? 1 : 0;
       begin->refarray = flags & REFARRAY_FLAG ? 1 : 0;
-      begin->weakref = flags & WEAKREF_FLAG ? 1 : 0;
-      memset(begin + 1, 0, len);
+      begin->weakref = flags & (WEAKREF_FLAG | EPHEMERON_FLAG) ? 1 : 0;
 
       return begin + 1;
     }
@@ -127,6 +217,107 @@ void *gc_create_ref(gclen_t len, gcofs_t atptr, int flags)
   return 0; 
 }
 
+static void rc_buffer(gc_meta *meta)
+{
+  if(meta->buffered) { return; }
+  if(rc_nroots == RC_ROOTS_MAX) { rc_roots_dropped = 1; return; }
+
+  meta->buffered = 1;
+  rc_roots[rc_nroots++] = meta;
+}
+
+static void rc_possible_root(gc_meta *meta)
+{
+  if(meta->color != RC_PURPLE)
+  {
+    meta->color = RC_PURPLE;
+    rc_buffer(meta);
+  }
+}
+
+static void rc_zct_add(gc_meta *meta)
+{
+  meta->zct = 1;
+  rc_zct[rc_nzct++] = meta;
+}
+
+static void weak_remove(gc_meta *meta)
+{
+  gc_weak_entry last = weak_table.back();
+  weak_table[meta->atptr] = last;
+  last.obj->atptr = meta->atptr;
+  weak_table.pop_back();
+}
+
+static void rc_decrement(gc_meta *meta);
+
+/*
+ *  Weak references to freed objects must be cleared before the
+ *  memory is reused. Ephemerons with a freed key drop their
+ *  value, which can free more keys, so go until nothing is.
+ *  A weak object that was itself released has let go already.
+ */
+static void rc_clear_weak()
+{
+  while(rc_freed)
+  {
+    rc_freed = 0;
+    for(size_t i = 0; i < weak_table.size(); i++)
+    {
+      gc_meta *obj = weak_table[i].obj;
+      void **ref = (void **)(obj + 1);
+      if(obj->collected || !*ref || !((gc_meta *)*ref)[-1].collected) { continue; }
+
+      *ref = 0;
+      if(weak_table[i].ephemeron && ref[1])
+      {
+        gc_meta *value = (gc_meta *)ref[1] - 1;
+        ref[1] = 0;
+
+        /* Can free weak objects and reorder the table, which sets rc_freed for another pass. */
+        rc_decrement(value);
+      }
+    }
+  }
+}
+
+static int gc_recover(int round, gclen_t need)
+{
+  if(!gc_limit_retry(round, need)) { return 0; }
+  collect_all(0);
+  return 1;
+}
+
+void *gc_create_ref(gclen_t len, gcofs_t atptr, int flags)
+{
+  if(rc_mode && rc_nroots == RC_ROOTS_MAX) { rc_collect_cycles(); }
+  if(gc_limit_due()) { collect_all(0); }
+  if(rc_freed && weak_table.size()) { rc_clear_weak(); }
+
+  void *alloc = gc_alloc(len, atptr, flags);
+  for(int round = 0; !alloc && gc_recover(round, len); round++)
+  { alloc = gc_alloc(len, atptr, flags); }
+  if(!alloc) { return 0; }
+
+  gc_meta *meta = (gc_meta *)alloc - 1;
+  heap_used += meta->len;
+  gc_limit_alloc(meta->len);
+  meta->color = RC_BLACK;
+  meta->buffered = 0;
+  meta->zct = 0;
+  if(meta->weakref)
+  {
+    gc_weak_entry entry = { meta, flags & EPHEMERON_FLAG ? 1 : 0 };
+    meta->atptr = weak_table.size();
+    weak_table.push_back(entry);
+  }
+
+  if(rc_mode && !meta->rrcnt) { rc_zct_add(meta); }
+
+  if(gc_record_on) { gc_record_alloc(alloc, len, atptr, flags); }
+  return alloc;
+}
+
 void gc_destroy_ref(void *alloc)
 {
   gc_meta *metadata = ((gc_meta *)alloc) - 1;
@@ -138,101 +329,570 @@ void gc_destroy_ref(void *alloc)
 
   if(metadata == begin) { begin = metadata->next; }
   metadata->collected = 1;
+  heap_used -= metadata->len;
+  memset(metadata + 1, 0, metadata->len - sizeof(gc_meta));
+  dead_headers[ndead_headers++] = metadata;
+
+  if(metadata->weakref) { weak_remove(metadata); }
+  if(rc_mode) { rc_freed = 1; }
+}
+
+/* The key is written directly so it is not counted. */
+void *gc_create_ephemeron(void *key, void *value, int flags)
+{
+  gc_ephemeron *eph = (gc_ephemeron *)gc_create_ref(sizeof(gc_ephemeron), 0,
+                                                    flags | EPHEMERON_FLAG);
+  if(!eph) { return 0; }
+
+  eph->key = key;
+  eph->value = 0;
+  gc_store_ref(eph, offsetof(gc_ephemeron, value), value);
+  return eph;
+}
+
+/* An ephemeron's value is its only counted reference, weak references have none. */
+static gclen_t rc_nchildren(gc_meta *meta)
+{
+  if(meta->weakref) { return weak_table[meta->atptr].ephemeron; }
+  if(meta->refarray) { return (meta->len - sizeof(gc_meta)) / sizeof(void *); }
+  return agg_table[meta->atptr];
+}
+
+static gc_meta *rc_child(gc_meta *meta, gclen_t i)
+{
+  void *base = meta + 1;
+  void *child;
+
+  if(meta->weakref) { child = ((gc_ephemeron *)base)->value; }
+  else if(meta->refarray) { child = ((void **)base)[i]; }
+  else { child = *(void **)((char *)base + agg_table[meta->atptr + 1 + i]); }
+
+  return child ? (gc_meta *)child - 1 : 0;
+}
+
+static void rc_increment(gc_meta *meta)
+{
+  meta->rrcnt++;
+  meta->color = RC_BLACK;
+}
+
+/*
+ *  Release, iteratively so long chains do not blow the stack.
+ *  A child that finds the mark stack full waits in the zero
+ *  count table, which always has room.
+ */
+static void rc_release(gc_meta *meta)
+{
+  if(meta->zct) { return; }    /* Released whole by rc_drain_zct */
+  gc_mark_push(&mark_stack, meta);
+
+  while(!gc_mark_empty(&mark_stack))
+  {
+    gc_meta *current = (gc_meta *)gc_mark_pop(&mark_stack);
+
+    gclen_t n = rc_nchildren(current);
+    for(gclen_t i = 0; i < n; i++)
+    {
+      gc_meta *child = rc_child(current, i);
+      if(!child) { continue; }
+
+      if(--child->rrcnt > 0) { rc_possible_root(child); }
+      else if(!child->zct && !gc_mark_push(&mark_stack, child)) { rc_zct_add(child); }
+    }
+
+    current->color = RC_BLACK;
+    /* Buffered objects are freed when the root buffer is scanned, weak references let go now. */
+    if(current->buffered)
+    {
+      current->collected = 1;
+      rc_freed = 1;
+    }
+    else { gc_destroy_ref(current + 1); }
+  }
+}
+
+static void rc_decrement(gc_meta *meta)
+{
+  if(--meta->rrcnt == 0) { rc_release(meta); }
+  else { rc_possible_root(meta); }
+}
+
+/*
+ *  The trial deletion walks use the mark stack too. An object
+ *  only takes its new color once its push fits, so a dropped
+ *  push shows up in the heap as a child without its parent's
+ *  color, which the rescans look for.
+ */
+static void rc_push(gc_meta *meta, int color)
+{
+  if(gc_mark_push(&mark_stack, meta)) { meta->color = color; }
+}
+
+/* Subtract internal references below what is on the stack. */
+static void rc_gray_drain()
+{
+  while(!gc_mark_empty(&mark_stack))
+  {
+    gc_meta *current = (gc_meta *)gc_mark_pop(&mark_stack);
+
+    gclen_t n = rc_nchildren(current);
+    for(gclen_t i = 0; i < n; i++)
+    {
+      gc_meta *child = rc_child(current, i);
+      if(!child) { continue; }
+
+      child->rrcnt--;
+      if(child->color != RC_GRAY) { rc_push(child, RC_GRAY); }
+    }
+  }
+}
+
+static void rc_rescan_gray()
+{
+  while(mark_stack.overflowed)
+  {
+    mark_stack.overflowed = 0;
+    for(gc_meta *trail = begin; trail; trail = trail->next)
+    {
+      if(trail->color != RC_GRAY) { continue; }
+
+      gclen_t n = rc_nchildren(trail);
+      for(gclen_t i = 0; i < n; i++)
+      {
+        gc_meta *child = rc_child(trail, i);
+        if(child && child->color != RC_GRAY) { rc_push(child, RC_GRAY); }
+      }
+      rc_gray_drain();
+    }
+  }
+}
+
+/*
+ *  Scanning pushes gray objects to decide on. Entries with
+ *  RC_RESTORE set are objects already turned black, which
+ *  give their children their counts back.
+ */
+#define RC_RESTORE 1
+
+static void rc_push_black(gc_meta *meta)
+{
+  if(gc_mark_push(&mark_stack, (char *)meta + RC_RESTORE)) { meta->color = RC_BLACK; }
+}
+
+static void rc_scan_drain()
+{
+  while(!gc_mark_empty(&mark_stack))
+  {
+    uintptr_t entry = (uintptr_t)gc_mark_pop(&mark_stack);
+    gc_meta *current = (gc_meta *)(entry & ~(uintptr_t)RC_RESTORE);
+    int restore = entry & RC_RESTORE;
+
+    if(!restore)
+    {
+      if(current->color != RC_GRAY) { continue; }
+
+      /* Externally referenced after all. The zero count table holds it as good as a reference. */
+      restore = current->rrcnt > 0 || current->zct;
+      current->color = restore ? RC_BLACK : RC_WHITE;
+    }
+
+    gclen_t n = rc_nchildren(current);
+    for(gclen_t i = 0; i < n; i++)
+    {
+      gc_meta *child = rc_child(current, i);
+      if(!child) { continue; }
+
+      if(!restore)
+      {
+        if(child->color == RC_GRAY) { gc_mark_push(&mark_stack, child); }
+      }
+      else
+      {
+        child->rrcnt++;
+        if(child->color != RC_BLACK) { rc_push_black(child); }
+      }
+    }
+  }
+}
+
+/* Gray objects left undecided, and whites under a black parent that were not given their counts back. */
+static void rc_rescan_scan()
+{
+  while(mark_stack.overflowed)
+  {
+    mark_stack.overflowed = 0;
+    for(gc_meta *trail = begin; trail; trail = trail->next)
+    {
+      if(trail->color == RC_GRAY) { gc_mark_push(&mark_stack, trail); }
+      else if(trail->color == RC_BLACK)
+      {
+        gclen_t n = rc_nchildren(trail);
+        for(gclen_t i = 0; i < n; i++)
+        {
+          gc_meta *child = rc_child(trail, i);
+          if(child && child->color == RC_WHITE) { rc_push_black(child); }
+        }
+      }
+      rc_scan_drain();
+    }
+  }
+}
+
+static void rc_white_drain()
+{
+  while(!gc_mark_empty(&mark_stack))
+  {
+    gc_meta *current = (gc_meta *)gc_mark_pop(&mark_stack);
+
+    gclen_t n = rc_nchildren(current);
+    for(gclen_t i = 0; i < n; i++)
+    {
+      gc_meta *child = rc_child(current, i);
+      if(child && child->color == RC_WHITE && !child->buffered) { rc_push(child, RC_BLACK); }
+    }
+
+    gc_destroy_ref(current + 1);
+  }
+}
+
+/* Frees as it goes, so push every white left first and drain after the walk. */
+static void rc_rescan_white()
+{
+  while(mark_stack.overflowed)
+  {
+    mark_stack.overflowed = 0;
+    for(gc_meta *trail = begin; trail; trail = trail->next)
+    {
+      if(trail->color == RC_WHITE) { rc_push(trail, RC_BLACK); }
+    }
+    rc_white_drain();
+  }
+}
+
+/* One trial deletion over the root buffer. */
+static void rc_collect_roots()
+{
+  size_t kept = 0;
+
+  if(gc_perf_on) { gc_perf_begin(GC_PERF_MARK); }
+  mark_stack.overflowed = 0;
+
+  /* Mark roots */
+  for(size_t i = 0; i < rc_nroots; i++)
+  {
+    gc_meta *meta = rc_roots[i];
+
+    if(meta->color == RC_PURPLE && meta->rrcnt > 0)
+    {
+      rc_push(meta, RC_GRAY);
+      rc_gray_drain();
+      rc_roots[kept++] = meta;
+    }
+    else
+    {
+      meta->buffered = 0;
+      if(meta->color == RC_BLACK && !meta->rrcnt && !meta->zct) { gc_destroy_ref(meta + 1); }
+    }
+  }
+  rc_nroots = kept;
+  rc_rescan_gray();
+
+  /* Scan roots */
+  for(size_t i = 0; i < rc_nroots; i++)
+  {
+    gc_mark_push(&mark_stack, rc_roots[i]);
+    rc_scan_drain();
+  }
+  rc_rescan_scan();
+
+  if(gc_perf_on)
+  {
+    gc_perf_end(GC_PERF_MARK);
+    gc_perf_begin(GC_PERF_SWEEP);
+  }
+
+  /* Collect roots */
+  for(size_t i = 0; i < rc_nroots; i++)
+  {
+    gc_meta *meta = rc_roots[i];
+    meta->buffered = 0;
+    if(meta->color == RC_WHITE)
+    {
+      rc_push(meta, RC_BLACK);
+      rc_white_drain();
+    }
+  }
+  rc_rescan_white();
+  rc_nroots = 0;
+
+  if(gc_perf_on) { gc_perf_end(GC_PERF_SWEEP); }
+}
+
+/* Candidates that found the buffer full are still purple, refill it from the heap until none are left. */
+static void rc_collect_cycles()
+{
+  rc_collect_roots();
+  while(rc_roots_dropped)
+  {
+    rc_roots_dropped = 0;
+    for(gc_meta *trail = begin; trail; trail = trail->next)
+    {
+      if(trail->color == RC_PURPLE && trail->rrcnt > 0) { rc_buffer(trail); }
+    }
+    rc_collect_roots();
+  }
+  if(gc_perf_on) { gc_perf_cycle(); }
+}
+
+/*
+ *  Release what is still at zero. The rest may only be held
+ *  by each other, so they become candidate roots. Only
+ *  between mutator calls.
+ */
+static void rc_drain_zct()
+{
+  for(size_t i = 0; i < rc_nzct; i++)
+  {
+    gc_meta *meta = rc_zct[i];
+    meta->zct = 0;
+    if(!meta->rrcnt) { rc_release(meta); }
+    else { rc_possible_root(meta); }
+  }
+  rc_nzct = 0;
+}
+
+void gc_rc_enable()
+{
+  rc_mode = 1;
+  gc_mark_init(&mark_stack, mark_space, sizeof(mark_space));
 }
 
 void gc_dec_ref(void *alloc)
 {
-  ((gc_meta *)alloc)[-1].rrcnt--;
+  if(rc_mode) { rc_decrement((gc_meta *)alloc - 1); }
+  else { ((gc_meta *)alloc)[-1].rrcnt--; }
+  if(gc_record_on) { gc_record_dec(alloc); }
 }
 
 void gc_inc_ref(void *alloc)
 {
-  ((gc_meta *)alloc)[-1].rrcnt++;
+  if(rc_mode) { rc_increment((gc_meta *)alloc - 1); }
+  else { ((gc_meta *)alloc)[-1].rrcnt++; }
+  if(gc_record_on) { gc_record_inc(alloc); }
+}
+
+/*
+ *  Store a strong reference to a field of alloc. Only needed
+ *  in reference counting mode, but always safe to use.
+ */
+void gc_store_ref(void *alloc, gcofs_t offset, void *value)
+{
+  void **field = (void **)((char *)alloc + offset);
+  void *old = *field;
+
+  if(rc_mode && value) { rc_increment((gc_meta *)value - 1); }
+  *field = value;
+  if(rc_mode && old) { rc_decrement((gc_meta *)old - 1); }
+  if(gc_record_on) { gc_record_store(alloc, offset, value); }
 }
 /* Tracing */
 void gc_collect()
 {
-  printf("Alive:\n");
+  if(gc_record_on) { gc_record_collect(); }
+  if(rc_mode) { rc_drain_zct(); }
+  collect_all(1);
+}
+
+/* Weak objects hold nothing strongly while tracing, ephemeron values are marked apart. */
+static void mark_children(gc_mark_stack *stack, void *obj)
+{
+  gc_meta *current = (gc_meta *)obj;
+  if(current->weakref) { return; }
+
+  gclen_t nchildren = rc_nchildren(current);
+  for(gclen_t i = 0; i < nchildren; i++)
+  {
+    gc_meta *meta = rc_child(current, i);
+    if(meta && !meta->mark)
+    {
+      meta->mark = 1;
+      gc_mark_push(stack, meta);
+    }
+  }
+}
+
+static void *mark_next_marked(void *obj)
+{
+  gc_meta *trail = obj ? ((gc_meta *)obj)->next : begin;
+  while(trail && !trail->mark) { trail = trail->next; }
+  return trail;
+}
+
+static const gc_mark_heap mark_heap = { mark_children, mark_next_marked, 0 };
+
+/*
+ *  A reachable ephemeron with a marked key keeps its value.
+ *  Marking a value can mark the key of another ephemeron, so
+ *  repeat until a pass marks nothing new.
+ */
+static void mark_ephemerons()
+{
+  int changed = 1;
+
+  while(changed)
+  {
+    changed = 0;
+    for(size_t i = 0; i < weak_table.size(); i++)
+    {
+      if(!weak_table[i].ephemeron || !weak_table[i].obj->mark) { continue; }
+
+      gc_ephemeron *eph = (gc_ephemeron *)(weak_table[i].obj + 1);
+      if(!eph->key || !eph->value || !((gc_meta *)eph->key)[-1].mark) { continue; }
+
+      gc_meta *value = (gc_meta *)eph->value - 1;
+      if(value->mark) { continue; }
+
+      value->mark = 1;
+      gc_mark_push(&mark_stack, value);
+      gc_mark_finish(&mark_stack, &mark_heap);
+      changed = 1;
+    }
+  }
+}
+
+/* Before the sweep, while unmarked referents still have their headers. */
+static void clear_weak()
+{
+  for(size_t i = 0; i < weak_table.size(); i++)
+  {
+    gc_meta *obj = weak_table[i].obj;
+    void **ref = (void **)(obj + 1);
+
+    /* Unmarked weak objects go in the sweep. */
+    if(!obj->mark || !*ref || ((gc_meta *)*ref)[-1].mark) { continue; }
+
+    *ref = 0;
+    if(weak_table[i].ephemeron) { ref[1] = 0; }
+  }
+}
+
+/*
+ *  Also runs on its own when allocation fails or nears the
+ *  soft limit, without dump, so allocating prints nothing.
+ *  gc_collect dumps the heap as it goes.
+ */
+static void collect_all(int dump)
+{
+  /* Counts are exact, only cycles are left to find. */
+  if(rc_mode)
+  {
+    rc_collect_cycles();
+    if(rc_freed && weak_table.size()) { rc_clear_weak(); }
+    gc_limit_pace();
+    return;
+  }
+
+  if(!mark_stack.nsegments) { gc_mark_init(&mark_stack, mark_space, sizeof(mark_space)); }
+
+  if(gc_perf_on) { gc_perf_begin(GC_PERF_MARK); }
+  if(dump) { printf("Alive:\n"); }
 
   for(gc_meta *trail = begin; trail; trail = trail->next)
   { 
-    printf("%p: %lld\n", trail, trail->rrcnt);
+    if(dump) { printf("%p: %lld\n", trail, trail->rrcnt); }
     if(trail->rrcnt > 0 && !trail->mark)
     {
       trail->mark = 1;
-      vector<gc_meta *>rem = vector<gc_meta *>();
-      rem.push_back(trail);
-      
-      while(rem.size())
-      {
-        gc_meta *current = rem.back();
-        void *base = current + 1;
-        rem.pop_back();
-
-        if(current->refarray)
-        {
-          for(int i = 0; 
-              i < (current->len - sizeof(gc_meta)) / sizeof(void *); 
-              i += sizeof(void *))
-          {
-            gc_meta *meta = ((gc_meta **)base)[i];
-
-            if(meta && !meta->mark) 
-            { 
-              rem.push_back(meta); 
-              meta->mark = 1; 
-            }
-          }
-        }
-        else
-        {
-          gcofs_t nchildren = agg_table[current->atptr];
-          for(gcofs_t i = current->atptr + 1; nchildren--; i++)
-          {
-            gc_meta *meta = *(gc_meta **)((char *)base + agg_table[i]);
-
-            if(meta-- && !meta->mark)
-            {
-              meta->mark = 1;
-              rem.push_back(meta);
-            }
-          } 
-        }
-      }
+      gc_mark_push(&mark_stack, trail);
+      gc_mark_drain(&mark_stack, &mark_heap);
     } 
   }
+  gc_mark_finish(&mark_stack, &mark_heap);
+  mark_ephemerons();
+  clear_weak();
+  if(gc_perf_on)
+  {
+    gc_perf_end(GC_PERF_MARK);
+    gc_perf_begin(GC_PERF_SWEEP);
+  }
 
-  printf("\nUnmarked:\n");
+  if(dump) { printf("\nUnmarked:\n"); }
 
   for(gc_meta *trail = begin; trail; trail = trail->next)
   {
     if(trail->mark) { trail->mark = 0; }
-    else { printf("%p\n", trail); gc_destroy_ref(trail + 1); }
+    else
+    {
+      if(dump) { printf("%p\n", trail); }
+      gc_destroy_ref(trail + 1);
+    }
   }
-
-  for(gc_meta *trail = begin; trail; trail = trail->next)
+  if(gc_perf_on)
   {
-    if(trail->weakref && *((void **)(trail + 1)))
-    { *((void **)(trail + 1)) = 0; }
+    gc_perf_end(GC_PERF_SWEEP);
+    gc_perf_cycle();
   }
+  gc_limit_pace();
 
-  printf("\n");
-
+  if(dump) { printf("\n"); }
 }
 
-int main()
+/* ./gcproto replay <trace> [rc] runs a GC_RECORD trace against this collector. */
+static void *replay_create(size_t len, size_t type, int flags)
+{ return gc_create_ref(len, type, flags); }
+
+static void replay_store(void *obj, size_t offset, void *value)
+{ gc_store_ref(obj, offset, value); }
+
+static const gc_replay_ops replay_ops =
 {
-  gc_ll *my_ref = (gc_ll *)gc_create_ref(sizeof (gc_ll), 1, 0);
-  gc_ll *my_ref1 = (gc_ll *)gc_create_ref(sizeof (gc_ll), 1, 0);
+  replay_create, 0, gc_inc_ref, gc_dec_ref, replay_store, gc_collect
+};
+
+int main(int argc, char **argv)
+{
+  const char *record = getenv("GC_RECORD");
+  if(record && gc_record_open(record)) { perror(record); }
+
+  /* Hardware counters per phase, GC_PERF_LOG=path also logs each cycle. */
+  const char *perf_env = getenv("GC_PERF");
+  const char *perf_log = getenv("GC_PERF_LOG");
+  if((perf_env && atoi(perf_env)) || perf_log) { gc_perf_enable(perf_log); }
+
+  if(argc > 2 && !strcmp(argv[1], "replay"))
+  {
+    if(argc > 3 && !strcmp(argv[3], "rc")) { gc_rc_enable(); }
+    return gc_replay(argv[2], &replay_ops);
+  }
+  if(argc > 1 && !strcmp(argv[1], "rc")) { gc_rc_enable(); }
+
+  gc_ll *my_ref = (gc_ll *)gc_create_ref(sizeof (gc_ll), 1, ROOT_FLAG);
+  gc_ll *my_ref1 = (gc_ll *)gc_create_ref(sizeof (gc_ll), 1, ROOT_FLAG);
   gc_weakref *my_ref2 = (gc_weakref *)gc_create_ref(sizeof(void *), 0, ROOT_FLAG | WEAKREF_FLAG);
 
-  my_ref->next = my_ref1;
-  my_ref1->prev = my_ref;
+  gc_store_ref(my_ref, offsetof(gc_ll, next), my_ref1);
+  gc_store_ref(my_ref1, offsetof(gc_ll, prev), my_ref);
   my_ref2->ref = my_ref;
 
+  /* Drop the roots, leaving the pair only referring to each other. */
+  gc_dec_ref(my_ref);
+  gc_dec_ref(my_ref1);
+
 
   gc_collect();
   printf("%p\n", my_ref2->ref);
+
+  /* A cache entry, kept while its key is. */
+  gc_ll *key = (gc_ll *)gc_create_ref(sizeof (gc_ll), 1, ROOT_FLAG);
+  gc_ll *value = (gc_ll *)gc_create_ref(sizeof (gc_ll), 1, 0);
+  gc_ephemeron *entry = (gc_ephemeron *)gc_create_ephemeron(key, value, ROOT_FLAG);
+
+  gc_collect();
+  printf("%p %p\n", entry->key, entry->value);
+
+  gc_dec_ref(key);
+  gc_collect();
+  printf("%p %p\n", entry->key, entry->value);
   
   return 0; 
 }
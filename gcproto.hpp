@@ -2,6 +2,7 @@
 #define GCPROTO_HPP
 
 #include <stdint.h>
+#include "gc_limit.hpp"
 
 typedef int64_t gcrcnt_t;
 typedef uint64_t gclen_t;
@@ -14,12 +15,15 @@ typedef uint64_t gcofs_t;
 
 struct gc_meta
 {
-  gcrcnt_t rrcnt : 60;    /* Roots Reference count */
+  gcrcnt_t rrcnt : 56;    /* Roots Reference count (all references in RC mode) */
+  gclen_t  color : 2;     /* Trial deletion color in RC mode */
+  gclen_t  buffered : 1;  /* In the RC mode candidate root buffer */
+  gclen_t  zct : 1;       /* In the RC mode zero count table */
   gcrcnt_t mark : 1;      /* Mark-sweep as back-up */
   gcrcnt_t refarray : 1;  /* Is an array of references. */
   gcrcnt_t collected : 1; /* For weak references referring to this reference. */
-  gcrcnt_t weakref   : 1; /* This object is a weak reference. */
-  gcofs_t  atptr;         /* Aggregate table pointer */ 
+  gcrcnt_t weakref   : 1; /* This object is a weak reference or an ephemeron. */
+  gcofs_t  atptr;         /* Aggregate table pointer, weak table index if weakref */
   gclen_t len;            /* Length of metadata */
   gc_meta *prev;          /* Metadata make doubly-linked list */
   gc_meta *next;
@@ -27,10 +31,32 @@ struct gc_meta
 
 #define ROOT_FLAG     1
 #define REFARRAY_FLAG 2
-#define WEAKREF_FLAG  4
+#define WEAKREF_FLAG   4
+#define EPHEMERON_FLAG 8
+
+/*
+ *  An ephemeron holds its value only as long as something
+ *  else holds its key. Once the key is unreachable both are
+ *  cleared. Use it as the entry of a weak-key map or cache.
+ *
+ *  Weak references and ephemerons are created with atptr 0
+ *  and may only be these payloads. The key, like a weak
+ *  reference, is written directly. The value is strong, so
+ *  store it with gc_store_ref. In reference counting mode a
+ *  value that refers back to its key keeps the key alive.
+ */
+struct gc_ephemeron
+{
+  void *key;
+  void *value;
+};
+
 void *gc_create_ref(gclen_t len, gcofs_t atptr, int flags);
+void *gc_create_ephemeron(void *key, void *value, int flags);
 void gc_dec_ref(void *alloc);
 void gc_inc_ref(void *alloc);
+void gc_store_ref(void *alloc, gcofs_t offset, void *value);
+void gc_rc_enable();
 void gc_collect();
 
 #endif
@@ -1,13 +1,15 @@
 #include "gc_concur.hpp"
+#include "../gc_heap.hpp"
+#include "../gc_phase.hpp"
+#include "../gc_mark.hpp"
+#include "../gc_record.hpp"
 
-#include <vector>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <windows.h>
 #include <assert.h>
 
-using std::vector;
-
 struct gc_ll
 { 
   gc_ll *prev, *next; 
@@ -54,13 +56,52 @@ static gc_meta *volatile begin;
 static const size_t heap_sz = 1 << 30;
 static align_t *test_heap;
 
+static volatile gclen_t ncycles;          /* Cycles the collector got to finish */
+static volatile gclen_t collected_bytes;  /* Written by the collector only */
+static gclen_t allocated_bytes;           /* Written by the allocator only */
+
+/* Mapped once in gc_init, marking never allocates. */
+#define MARK_STACK_SZ ((size_t)1 << 20)
+static gc_mark_stack mark_stack;
+
+/*
+ *  Soft heap limit. Every allocation restarts the collector's
+ *  mark, so near the limit the allocator lets it finish a
+ *  cycle. After that the mutator may allocate half the room
+ *  left under the limit before waiting again.
+ */
+#define SOFT_MIN_BUDGET ((gclen_t)64 << 10)
+
+static uint64_t soft_used() { return allocated_bytes - collected_bytes; }
+const gc_limit_ops gc_limit_collector = { SOFT_MIN_BUDGET, soft_used };
+
 void gc_init()
 {
-  test_heap = (align_t *)malloc(heap_sz);
+  test_heap = (align_t *)gc_heap_map(heap_sz, gc_heap_env_flags());
+  gc_mark_init(&mark_stack, gc_heap_map(MARK_STACK_SZ, 0), MARK_STACK_SZ);
+
+  /* Hardware counters per phase, GC_PERF_LOG=path also logs each cycle. */
+  const char *perf_env = getenv("GC_PERF");
+  const char *perf_log = getenv("GC_PERF_LOG");
+  if((perf_env && atoi(perf_env)) || perf_log) { gc_perf_enable(perf_log); }
+
+  /* Timeline for chrome://tracing, written at exit, e.g. GC_EVENTS=gc.json */
+  const char *events = getenv("GC_EVENTS");
+  if(events)
+  {
+    gc_event_enable(events);
+    gc_event_name_thread("mutator");
+  }
+
   CreateThread(0, 0, (LPTHREAD_START_ROUTINE)collector_thread, 0, 0, 0);
 }
 
-gcref_t gc_create_ref(gclen_t len, gcofs_t srtptr, int flags)
+/*
+ *  One first-fit pass. Unlinks collected objects on the way
+ *  and sets *collected if it did, since that may have opened
+ *  a gap behind the pass.
+ */
+static gcref_t gc_fit(gclen_t len, gcofs_t srtptr, int flags, int *collected)
 {
   gclen_t true_len = (len + sizeof(gc_meta) + sizeof(align_t) - 1) &
                      ~(sizeof(align_t) - 1);
@@ -68,7 +109,6 @@ gcref_t gc_create_ref(gclen_t len, gcofs_t srtptr, int flags)
   gc_meta *trail, *local_begin = begin;
   char *test = 0;
   gclen_t last_len = 0;
-  int collected = 0;
 
   while(local_begin && local_begin->collected) 
   { 
@@ -101,11 +141,10 @@ gcref_t gc_create_ref(gclen_t len, gcofs_t srtptr, int flags)
 
   while(trail)
   {
-    last_len = trail->len;
-    test = (char *)trail + last_len;
     gc_meta *local_next = trail->next;
     gc_meta *local_prev = trail->prev;  
 
+    /* Test stays behind the last live object, the tail goes after that one. */
     if(trail->collected)
     {
       if(local_prev) 
@@ -113,9 +152,14 @@ gcref_t gc_create_ref(gclen_t len, gcofs_t srtptr, int flags)
       if(local_next)
       { local_next->prev = local_prev; }
 
-      collected = 1;
+      *collected = 1;
+      trail = local_next;
+      continue;
     }
-    else if(test + true_len < (char *)local_next)
+
+    last_len = trail->len;
+    test = (char *)trail + last_len;
+    if(test + true_len < (char *)local_next)
     {
       gc_meta *retmeta = (gc_meta *)test;
 
@@ -180,23 +224,100 @@ gcref_t gc_create_ref(gclen_t len, gcofs_t srtptr, int flags)
     }
   }
 
+  return 0;
+}
 
-  if(collected) 
-  { 
-    return gc_create_ref(len, srtptr, flags); 
+/* Waits for the collector to finish a cycle that started after the call. */
+static void wait_cycle()
+{
+  gclen_t start = ncycles;
+  if(gc_event_on) { gc_event_begin("alloc stall"); }
+  while(ncycles - start < 2) { Sleep(0); }
+  if(gc_event_on) { gc_event_end("alloc stall"); }
+}
+
+/*
+ *  Allocation failed. Round 0 waits for a full collection,
+ *  round 1 waits for another if the low-memory callback let
+ *  go of something. Returns 0 once there is nothing left to try.
+ */
+static int gc_recover(int round, gclen_t need)
+{
+  if(!gc_limit_retry(round, need)) { return 0; }
+  wait_cycle();
+  gc_limit_pace();
+  return 1;
+}
+
+static gcref_t gc_fit_all(gclen_t len, gcofs_t srtptr, int flags)
+{
+  gcref_t alloc;
+  int collected;
+
+  do
+  {
+    collected = 0;
+    alloc = gc_fit(len, srtptr, flags, &collected);
+  } while(!alloc && collected);
+
+  return alloc;
+}
+
+/* Returns 0 when the heap is exhausted. */
+gcref_t gc_create_ref(gclen_t len, gcofs_t srtptr, int flags)
+{
+  if(gc_limit_due())
+  {
+    wait_cycle();
+    gc_limit_pace();
   }
 
-  assert(0);
+  gcref_t alloc = gc_fit_all(len, srtptr, flags);
+  for(int round = 0; !alloc && gc_recover(round, len); round++)
+  { alloc = gc_fit_all(len, srtptr, flags); }
+  if(!alloc) { return 0; }
 
-  return 0;
+  allocated_bytes += ((gc_meta *)alloc)[-1].len;
+  gc_limit_alloc(((gc_meta *)alloc)[-1].len);
+  return alloc;
+}
+
+static void mark_children(gc_mark_stack *stack, void *obj)
+{
+  gc_meta *current = (gc_meta *)obj;
+  void *base = current + 1;
+  gcofs_t nchildren = strong_table[current->srtptr];
+
+  for(gcofs_t i = current->srtptr + 1; nchildren--; i++)
+  {
+    gc_meta *child_meta = *(gc_meta **)((char *)base + strong_table[i]);
+    if(child_meta-- && !child_meta->mark)
+    {
+      child_meta->mark = 1;
+      gc_mark_push(stack, child_meta);
+    }
+  }
 }
 
+static void *mark_next_marked(void *obj)
+{
+  gc_meta *meta = obj ? ((gc_meta *)obj)->next : begin;
+  while(meta && (meta->collected || !meta->mark)) { meta = meta->next; }
+  return meta;
+}
+
+/* The mutator invalidating the mark stops it early, leaving the rest on the stack. */
+static const gc_mark_heap mark_heap = { mark_children, mark_next_marked, &invalidate_collector };
+
 void collector_thread()
 {
   gc_meta *local_meta;
+
+  if(gc_event_on) { gc_event_name_thread("collector"); }
   while(1)
   {
-    /* Remove all marks. */
+    /* Remove all marks. Phases cut short by the mutator still count. */
+    gc_phase_begin(GC_PERF_CLEAR);
     while(invalidate_collector)
     {
       invalidate_collector = 0;
@@ -204,12 +325,12 @@ void collector_thread()
       while(local_meta && !invalidate_collector) 
       { 
         if(!local_meta->collected && !invalidate_collector)
-        {
-          local_meta->mark = 0;
-          local_meta = local_meta->next;
-        }
+        { local_meta->mark = 0; }
+        local_meta = local_meta->next;
       }
     } 
+    gc_phase_end(GC_PERF_CLEAR);
+    gc_phase_begin(GC_PERF_MARK);
 
     /* Move on to mark phase. */
     local_meta = begin;
@@ -220,31 +341,20 @@ void collector_thread()
         if(local_meta->rrcnt > 0 && !local_meta->mark)
         {
           local_meta->mark = 1;
-          vector<gc_meta *> rem = vector<gc_meta *>();
-          rem.push_back(local_meta);
-
-          while(rem.size())
-          {
-            gc_meta *current = rem.back();
-            void *base = current + 1;
-            rem.pop_back();
-
-            gcofs_t nchildren = strong_table[current->srtptr];
-            for(gcofs_t i = current->srtptr + 1; nchildren--; i++)
-            {
-              gc_meta *child_meta = *(gc_meta **)((char *)base + strong_table[i]);
-              if(child_meta-- && !child_meta->mark)
-              {
-                child_meta->mark = 1;
-                rem.push_back(child_meta);
-              }
-            }
-          }
+          gc_mark_push(&mark_stack, local_meta);
+          gc_mark_drain(&mark_stack, &mark_heap);
         }
       }
 
       local_meta = local_meta->next;
     }
+    gc_mark_finish(&mark_stack, &mark_heap);
+    gc_phase_end(GC_PERF_MARK);
+    if(invalidate_collector)
+    {
+      gc_mark_reset(&mark_stack);
+      if(gc_event_on) { gc_event_instant("mark restart", 0); }
+    }
 
     /* 
      * Move on to the sweep phase only if mark phase was actually complete.
@@ -253,16 +363,29 @@ void collector_thread()
      */
     if(!invalidate_collector)
     {
+      gc_phase_begin(GC_PERF_SWEEP);
       local_meta = begin;
       while(local_meta && !invalidate_collector)
       {
         if(!local_meta->collected && !invalidate_collector)
         {
-          if(!local_meta->mark) { local_meta->collected = 1; }
+          if(!local_meta->mark)
+          {
+            collected_bytes = collected_bytes + local_meta->len;
+            local_meta->collected = 1;
+          }
           else { local_meta->mark = 0; }
-          local_meta = local_meta->next;
         }
+        local_meta = local_meta->next;
       }
+      gc_phase_end(GC_PERF_SWEEP);
+      if(!local_meta)
+      {
+        ncycles = ncycles + 1;
+        gc_phase_cycle_end(ncycles);
+        if(gc_event_on) { gc_event_counter("heap_used", allocated_bytes - collected_bytes); }
+      }
+      else if(gc_event_on) { gc_event_instant("sweep cut short", 0); }
     }
 /* -------------------------------------------------- */
   }
@@ -281,9 +404,36 @@ void gc_inc_ref(void *alloc)
   ((gc_meta *)alloc)[-1].rrcnt++;
 }
 
-int main()
+/*
+ *  ./gc_concur replay <trace> runs a GC_RECORD trace against
+ *  this collector. The type table matches gcproto's, so its
+ *  traces replay as they are.
+ */
+static gcref_t replay_create(size_t len, size_t type, int flags)
+{ return gc_create_ref(len, type, flags); }
+
+/* A store can hide an object from the mark, so it restarts it like an allocation does. */
+static void replay_store(void *obj, size_t offset, void *value)
+{
+  *(void **)((char *)obj + offset) = value;
+  invalidate_collector = 1;
+}
+
+static void replay_collect()
+{
+  wait_cycle();
+  gc_limit_pace();
+}
+
+static const gc_replay_ops replay_ops =
+{
+  replay_create, 0, gc_inc_ref, gc_dec_ref, replay_store, replay_collect
+};
+
+int main(int argc, char **argv)
 {
   gc_init();
+  if(argc > 2 && !strcmp(argv[1], "replay")) { return gc_replay(argv[2], &replay_ops); }
   
   gc_ll *myref1;
   while(1) 
@@ -2,6 +2,7 @@
 #define GC_CONCUR_HPP
 
 #include <stdint.h>
+#include "../gc_limit.hpp"
 
 typedef uint64_t gcrcnt_t;
 typedef uint64_t gclen_t;